@@ -1,7 +1,16 @@
 #include <ncurses.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 
 /* BEGIN CONFIG */
 #ifndef X
@@ -13,7 +22,6 @@
 #endif /* Y */
 
 #ifndef SEED
-#include <time.h>
 #define SEED time(NULL)
 #endif /* SEED */
 
@@ -25,6 +33,11 @@
 #define PATH_BENDS 3
 #endif /* PATH_BENDS */
 
+#ifndef OPEN_MAP
+// no fixed path, enemies take the shortest way around turrets (0 or 1)
+#define OPEN_MAP 0
+#endif /* OPEN_MAP */
+
 #ifndef ATTACK_ANIMATION_DELAY
 #define ATTACK_ANIMATION_DELAY 35
 #endif /* ATTACK_ANIMATION_DELAY */
@@ -34,7 +47,7 @@
 #endif /* MAX_ENEMIES */
 
 #ifndef MAX_TURRETS
-#define MAX_TURRETS 128
+#define MAX_TURRETS 4096
 #endif /* MAX_TURRETS */
 
 #ifndef STARTING_CASH
@@ -48,6 +61,29 @@
 #ifndef STARTING_ROUND
 #define STARTING_ROUND 1
 #endif /* STARTING_ROUND */
+
+#ifndef MAX_TICKS
+// tick limit for a single headless game
+#define MAX_TICKS 200000
+#endif /* MAX_TICKS */
+
+#ifndef CHECKSUM_TICKS
+// ticks between state checksums in recordings
+#define CHECKSUM_TICKS 100
+#endif /* CHECKSUM_TICKS */
+
+#ifndef SAVE_FILE
+#define SAVE_FILE "td.save"
+#endif /* SAVE_FILE */
+
+#ifndef PROF_SAMPLES
+// frames kept by the profiler
+#define PROF_SAMPLES 1024
+#endif /* PROF_SAMPLES */
+
+#ifndef TRACE_FILE
+#define TRACE_FILE "td.trace.json"
+#endif /* TRACE_FILE */
 /* END CONFIG */
 
 #define ARRLEN(a) (sizeof(a)/sizeof(*a))
@@ -65,16 +101,42 @@
 #define INT_TO_CELL_TURRET(i) (((i) & (CELL_TURRET_MASK >> 4)) << 4)
 #define CELL_TURRET_TO_INT(c) (((c) & CELL_TURRET_MASK) >> 4)
 
-#define SHOP_STARTX (X + 2)
+#define SHOP_STARTX (view.w + 2)
 #define SHOP_STARTY (1)
 
 #define SHOP_ID_TO_X(id) (SHOP_STARTX)
 #define SHOP_ID_TO_Y(id) ((id) * 2 + SHOP_STARTY + 2)
 
+// most distinct attack/movement periods alive at once
+#define MAX_PERIODS 32
+
+// largest wave, and the part of a wave each extra enemy in a spawned group
+// stands for
+#define MAX_WAVE (1 << 24)
+#define WAVE_BATCH 1024
+
+// wave sizes for rounds 21 to 40, and round 41 where waves start growing.
+// these were two thirds and seven eighths of the original MAX_ENEMIES = 256,
+// and stay fixed now that waves are no longer capped by it
+#define WAVE_MID 170
+#define WAVE_LATE 224
+
+// turrets per parallel targeting job, and the due turrets times enemies below
+// which a tick's targeting isn't worth spreading over threads. a pair takes
+// about 1ns to scan, so this is ~8us against about 1us for waking the pool
+#define TARGET_CHUNK 64
+#define TARGET_PARALLEL_WORK (1 << 13)
+
 #define Y_TO_SHOP_ID(y) (((y) - SHOP_STARTY) % 2 == 1 ?     \
                          (-1) :                             \
                          (((y) - SHOP_STARTY - 2) / 2))
 
+// widest text drawn in the shop column
+#define SHOP_WIDTH 22
+
+// cells moved per arrow key or mouse wheel step
+#define VIEW_SCROLL 4
+
 
 enum color {
 	RED = 1,
@@ -105,20 +167,42 @@ enum cell_path {
 	CELL_PATH_RIGHT,
 };
 
+enum action {
+	ACTION_NONE,
+	ACTION_UPGRADE,
+	ACTION_SELL,
+};
+
+
+// entities grouped by the period (in ticks) they act on. group i is the
+// sorted run order[start[i]] .. order[start[i + 1] - 1] of entity indices
+struct schedule {
+	int n_periods;
+	int periods[MAX_PERIODS];
+	int start[MAX_PERIODS + 1];
+};
+
 
 struct enemies {
+	// a group of enemies on the same cell moving at the same speed. single
+	// target attacks hit the one in front until it dies
 	struct enemy {
 		int x;
 		int y;
-		int count;
+		int count; // stack of the enemy in front, 0 once the group is dead
 		int ticks;
+		int n;     // enemies behind it
+		int stack; // stack of each of those
 	} enemies[MAX_ENEMIES];
 
 	int idx;
+	struct schedule sched;
+	int order[MAX_ENEMIES];
 	int last_round;
 	int spawned;
 	int killed;
 	int to_spawn;
+	long dropped; // spawns turned away with every group in use
 
 	int spawnx;
 	int spawny;
@@ -187,32 +271,275 @@ struct turrets {
 	} spawned[MAX_TURRETS];
 
 	int idx;
-} spawned_turrets;
+	struct schedule sched;
+	int order[MAX_TURRETS];
+	int changes; // bumped whenever a turret is placed, upgraded or removed
+};
+
+
+// map dimensions, X and Y unless given on the command line
+#define MAX_DIM 16384
+int width = X;
+int height = Y;
+
+// enemies follow the flow field instead of a generated path
+bool open_map = OPEN_MAP;
+
+
+// everything needed to simulate one game, independent of any other game.
+// the map (and on open maps, the flow field) is stored inline after the
+// struct, so a game is a single flat block of game_size() bytes
+struct game {
+	struct enemies enemies;
+	struct turrets spawned_turrets;
+
+	int cash;
+	int lives;
+	int round;
+	int score;
+
+	unsigned long ticks;
+	uint64_t rng;
+
+	char cells[];
+};
+
+#define GRID(g) ((char (*)[height])(g)->cells)
+
+
+// what part of the map is on screen, and what it looked like when drawn
+struct view {
+	int x;        // map cell at the top left of the screen
+	int y;
+	int w;        // number of map cells on screen
+	int h;
+
+	WINDOW * map; // the visible map and its border, rendered once per change
+	int changes;  // spawned_turrets.changes the map was rendered at
+	bool valid;   // false when the whole screen has to be redrawn
+
+	int n;        // enemies drawn last frame, in screen coordinates
+	int ex[MAX_ENEMIES];
+	int ey[MAX_ENEMIES];
+
+	// draw_heat()'s summed-area table, kept until the view, the radius or the
+	// turrets change
+	struct {
+		int * sum;
+		int x, y, w, h;
+		int r;
+		int changes;
+		int best; // most path cells in range of a free cell in view
+	} heat;
+} view;
+
+
+// set when running without a terminal (no drawing, no animation delays)
+bool headless = false;
+
+// whether the turrets' targets within a game are found on the thread pool,
+// set when it has threads to spare
+bool parallel_targets = false;
+
+
+// the flow field's offset into cells, aligned for its ints
+size_t flow_offset(void) {
+	return ((size_t)width * height + sizeof(int) - 1) & ~(sizeof(int) - 1);
+}
+
+
+size_t game_size(void) {
+	size_t cells = (size_t)width * height;
+	if (open_map) return sizeof(struct game) + flow_offset() + cells * sizeof(int);
+	return sizeof(struct game) + cells;
+}
+
+
+struct game * game_new(void) {
+	return malloc(game_size());
+}
+
+
+void game_copy(struct game * dst, struct game * src) {
+	memcpy(dst, src, game_size());
+}
+
+
+int sched_find(struct schedule * s, int period) {
+	for (int p = 0; p < s->n_periods; p++) {
+		if (s->periods[p] == period) return p;
+	}
+	return -1;
+}
+
+
+void sched_insert(struct schedule * s, int * order, int i, int period) {
+	int p = sched_find(s, period);
+	if (p < 0) {
+		// can't happen with the periods in turrets[] and get_speed()
+		if (s->n_periods == MAX_PERIODS) return;
+		p = s->n_periods++;
+		s->periods[p] = period;
+		s->start[p + 1] = s->start[p];
+	}
+
+	int n = s->start[s->n_periods];
+	int k = s->start[p + 1];
+	while (k > s->start[p] && order[k - 1] > i) k--;
+	memmove(&order[k + 1], &order[k], (n - k) * sizeof(*order));
+	order[k] = i;
+	for (int q = p + 1; q <= s->n_periods; q++) s->start[q]++;
+}
+
+
+// when renumber is set, the entities after i are renumbered to match their
+// entity array being shifted down over i
+void sched_remove(
+	struct schedule * s, int * order, int i, int period, bool renumber
+) {
+	int p = sched_find(s, period);
+	if (p < 0) return;
+	int k = s->start[p];
+	while (k < s->start[p + 1] && order[k] != i) k++;
+	if (k == s->start[p + 1]) return;
+
+	int n = s->start[s->n_periods] - 1;
+	memmove(&order[k], &order[k + 1], (n - k) * sizeof(*order));
+	for (int q = p + 1; q <= s->n_periods; q++) s->start[q]--;
+
+	if (s->start[p] == s->start[p + 1]) {
+		s->n_periods--;
+		memmove(&s->periods[p], &s->periods[p + 1],
+		        (s->n_periods - p) * sizeof(*s->periods));
+		memmove(&s->start[p + 1], &s->start[p + 2],
+		        (s->n_periods - p) * sizeof(*s->start));
+	}
 
+	if (renumber) for (k = 0; k < n; k++) {
+		if (order[k] > i) order[k]--;
+	}
+}
+
+
+// collects the entities acting on this tick, in ascending order, into due
+int sched_due(struct schedule * s, int * order, unsigned long ticks, int * due) {
+	int cur[MAX_PERIODS];
+	int end[MAX_PERIODS];
+	int groups = 0;
+	for (int p = 0; p < s->n_periods; p++) {
+		if (ticks % s->periods[p] != 0) continue;
+		cur[groups] = s->start[p];
+		end[groups] = s->start[p + 1];
+		groups++;
+	}
+
+	// merge the due groups
+	int n = 0;
+	while (true) {
+		int best = -1;
+		for (int g = 0; g < groups; g++) {
+			if (cur[g] == end[g]) continue;
+			if (best < 0 || order[cur[g]] < order[cur[best]]) best = g;
+		}
+		if (best < 0) break;
+		due[n++] = order[cur[best]++];
+	}
+	return n;
+}
+
+
+// stack of every enemy in a group
+int enemy_units(struct enemy * e) {
+	return e->count + e->n * e->stack;
+}
 
-unsigned long ticks = 0;
 
+// pushes n enemies as one group, or joins the last group with the same speed
+// if it hasn't left the cell yet. groups with the same speed move together, so
+// no earlier one can still be there
+void enemies_push(
+	struct enemies * enemies, int x, int y, int count, int ticks, int n
+) {
+	int p = sched_find(&enemies->sched, ticks);
+	if (p >= 0) {
+		int last = enemies->order[enemies->sched.start[p + 1] - 1];
+		struct enemy * e = &enemies->enemies[last];
+		if (e->x == x && e->y == y && (e->n == 0 || e->stack == count)) {
+			e->n += n;
+			e->stack = count;
+			enemies->spawned += n * count;
+			return;
+		}
+	}
 
-void enemies_push(struct enemies * enemies, int x, int y, int count, int ticks) {
+	// spawned isn't counted, so the wave goes on until they get in later
 	int idx = enemies->idx;
+	if (idx >= MAX_ENEMIES) {
+		enemies->dropped++;
+		return;
+	}
 	enemies->enemies[idx].x = x;
 	enemies->enemies[idx].y = y;
 	enemies->enemies[idx].count = count;
 	enemies->enemies[idx].ticks = ticks;
-	enemies->spawned += count;
+	enemies->enemies[idx].n = n - 1;
+	enemies->enemies[idx].stack = count;
+	enemies->spawned += n * count;
 	enemies->idx++;
+
+	sched_insert(&enemies->sched, enemies->order, idx, ticks);
+}
+
+
+// removes every enemy with a count of 0 in a single pass
+void enemies_compact(struct enemies * enemies) {
+	int n = 0;
+	while (n < enemies->idx && enemies->enemies[n].count) n++;
+	if (n == enemies->idx) return;
+
+	int moved[MAX_ENEMIES];
+	for (int i = 0; i < n; i++) moved[i] = i;
+	for (int i = n; i < enemies->idx; i++) {
+		if (enemies->enemies[i].count == 0) {
+			moved[i] = -1;
+			continue;
+		}
+		moved[i] = n;
+		enemies->enemies[n++] = enemies->enemies[i];
+	}
+	enemies->idx = n;
+
+	// renumber the schedule, dropping periods left empty
+	struct schedule * s = &enemies->sched;
+	int k = 0;
+	int periods = 0;
+	for (int p = 0; p < s->n_periods; p++) {
+		int begin = k;
+		for (int j = s->start[p]; j < s->start[p + 1]; j++) {
+			int i = moved[enemies->order[j]];
+			if (i >= 0) enemies->order[k++] = i;
+		}
+		if (k == begin) continue;
+		s->periods[periods] = s->periods[p];
+		s->start[periods] = begin;
+		periods++;
+	}
+	s->n_periods = periods;
+	s->start[periods] = k;
 }
 
 
 void enemies_pop(struct enemies * enemies, int i) {
+	sched_remove(&enemies->sched, enemies->order, i,
+	             enemies->enemies[i].ticks, true);
 	enemies->idx--;
 	memmove(&enemies->enemies[i], &enemies->enemies[i + 1],
-	        (MAX_ENEMIES - (i + 1)) * sizeof(*enemies->enemies));
+	        (enemies->idx - i) * sizeof(*enemies->enemies));
 }
 
 
 void turrets_push(
-	struct turrets * spawned_turrets, char grid[X][Y], int x, int y, int id
+	struct turrets * spawned_turrets, char grid[width][height], int x, int y, int id
 ) {
 	int idx = spawned_turrets->idx;
 	spawned_turrets->spawned[idx].x = x;
@@ -227,35 +554,59 @@ void turrets_push(
 	spawned_turrets->spawned[idx].level = 0;
 	spawned_turrets->spawned[idx].kills = 0;
 	spawned_turrets->idx++;
+	spawned_turrets->changes++;
 
+	sched_insert(&spawned_turrets->sched, spawned_turrets->order, idx,
+	             turrets[id].ticks);
 	grid[x][y] |= CELL_TURRET | INT_TO_CELL_TURRET(id);
 }
 
-void turrets_pop(struct turrets * spawned, char grid[X][Y], int x, int y, int i) {
+void turrets_pop(struct turrets * spawned, char grid[width][height], int x, int y, int i) {
+	sched_remove(&spawned->sched, spawned->order, i,
+	             spawned->spawned[i].ticks, true);
 	spawned->idx--;
+	spawned->changes++;
 	memmove(&spawned->spawned[i], &spawned->spawned[i + 1],
-	        (MAX_TURRETS - (i + 1)) * sizeof(*spawned->spawned));
+	        (spawned->idx - i) * sizeof(*spawned->spawned));
+
+	grid[x][y] &= ~(CELL_TURRET | CELL_TURRET_MASK);
+}
 
-	grid[x][y] &= ~CELL_TURRET | INT_TO_CELL_TURRET(0xFF);
+
+// splitmix64, so that every game carries its own PRNG state
+uint32_t rng_next(uint64_t * rng) {
+	uint64_t z = (*rng += 0x9E3779B97F4A7C15);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+	return (z ^ (z >> 31)) >> 33;
 }
 
 
-int rand_range(int lo, int hi) {
-	return rand() % (hi - lo) + lo;
+int rand_range(uint64_t * rng, int lo, int hi) {
+	return (int)(rng_next(rng) % (unsigned)(hi - lo)) + lo;
 }
 
 
-void generate_path(char grid[X][Y], struct enemies * enemies) {
+void generate_path(char grid[width][height], struct enemies * enemies, uint64_t * rng) {
 	int spawnx = 0;
-	int spawny = rand() % Y;
+	int spawny = rand_range(rng, 0, height);
 	enemies->spawnx = spawnx;
 	enemies->spawny = spawny;
+	// the flow field makes the path
+	if (open_map) return;
+
+	// PATH_BENDS is for a map X cells wide
+	int bends = PATH_BENDS * width / X;
+	if (bends < 1) bends = 1;
 
 	int lastx = spawnx;
 	int lasty = spawny;
-	for (int i = 0; i < PATH_BENDS; i++) {
-		int bendx = rand_range(lastx + 1, (i + 1) * X / PATH_BENDS);
-		int bendy = rand_range(0, Y);
+	for (int i = 0; i < bends; i++) {
+		int lo = lastx + 1;
+		int hi = (i + 1) * width / bends;
+		int bendx = hi > lo ? rand_range(rng, lo, hi) : lo;
+		if (bendx >= width) break;
+		int bendy = rand_range(rng, 0, height);
 
 		// horizontal run
 		for (int x = lastx; x < bendx; x++) {
@@ -276,13 +627,416 @@ void generate_path(char grid[X][Y], struct enemies * enemies) {
 	}
 
 	// connect to edge
-	for (int x = lastx; x < X; x++) {
+	for (int x = lastx; x < width; x++) {
 		grid[x][lasty] |= CELL_PATH | INT_TO_CELL_PATH(CELL_PATH_RIGHT);
 	}
 }
 
 
-char grid_getc(char grid[X][Y], int x, int y) {
+bool can_place(char grid[width][height], int id, int x, int y) {
+	if (x < 0 || x >= width || y < 0 || y >= height) return false;
+	// turrets with a nonnegative stack must be placed on paths
+	// other turrets can only by placed on empty cells, or anywhere on open maps
+	if ((grid[x][y] & CELL_TURRET) ||
+	       (turrets[id].stack < 0 && (grid[x][y] & CELL_PATH) && !open_map)) {
+		return false;
+	}
+	if (turrets[id].stack > 0 && !(grid[x][y] & CELL_PATH)) return false;
+	return true;
+}
+
+
+int find_turret(struct turrets * spawned, int x, int y) {
+	for (int i = 0; i < spawned->idx; i++) {
+		if (spawned->spawned[i].x == x && spawned->spawned[i].y == y) return i;
+	}
+	return -1;
+}
+
+
+int sell_value(struct spawned_turret * st) {
+	int tid = st->id;
+	// sell for 75% of purchasing cost
+	int selling = 0;
+	selling += turrets[tid].cost;
+	for (int i = 0; i < st->level; i++) {
+		selling += turrets[tid].upgrades[i].cost;
+	}
+	if (turrets[tid].stack > 0) {
+		selling *= st->stack;
+		selling /= turrets[tid].stack;
+	}
+	selling *= 3;
+	selling /= 4;
+	return selling;
+}
+
+
+/* flow field */
+
+// on open maps every cell stores its distance to the right edge, and its path
+// bits point at the neighbour to step to. turrets other than spikes block
+// their cell, and are only allowed where the spawn and every enemy can still
+// get out. cells on the spawn's route are marked as path
+
+#define FLOW_INF INT_MAX
+
+
+int * flow_dist(struct game * g) {
+	return (int *)(g->cells + flow_offset());
+}
+
+
+struct vec {
+	int * v;
+	int n;
+	int cap;
+};
+
+
+// scratch space for field updates, per thread since batch games run in
+// parallel. it lives as long as the thread, so pool workers free it on exit
+_Thread_local struct vec flow_queue, flow_log, flow_seeds;
+
+
+void flow_scratch_free(void) {
+	free(flow_queue.v);
+	free(flow_log.v);
+	free(flow_seeds.v);
+}
+
+
+void vec_push(struct vec * v, int a) {
+	if (v->n == v->cap) {
+		v->cap = v->cap ? v->cap * 2 : 1024;
+		v->v = realloc(v->v, v->cap * sizeof(*v->v));
+	}
+	v->v[v->n++] = a;
+}
+
+
+bool flow_blocked(char c) {
+	return (c & CELL_TURRET) && turrets[CELL_TURRET_TO_INT(c)].stack < 0;
+}
+
+
+// neighbours of cell i in the order enemies prefer them, -1 if off the map
+const int flow_dirs[4] = {
+	CELL_PATH_RIGHT, CELL_PATH_DOWN, CELL_PATH_UP, CELL_PATH_LEFT,
+};
+
+void flow_neighbours(int i, int n[4]) {
+	int x = i / height;
+	int y = i % height;
+	n[0] = x + 1 < width ? i + height : -1;
+	n[1] = y + 1 < height ? i + 1 : -1;
+	n[2] = y > 0 ? i - 1 : -1;
+	n[3] = x > 0 ? i - height : -1;
+}
+
+
+// points cell i at its nearest neighbour, the right edge leads off the map
+void flow_point(struct game * g, int i) {
+	int * dist = flow_dist(g);
+	int dir = CELL_PATH_RIGHT;
+	if (i / height < width - 1) {
+		int n[4];
+		flow_neighbours(i, n);
+		int best = FLOW_INF;
+		dir = CELL_PATH_TO_INT(g->cells[i]);
+		for (int k = 0; k < 4; k++) {
+			if (n[k] < 0 || dist[n[k]] >= best) continue;
+			best = dist[n[k]];
+			dir = flow_dirs[k];
+		}
+	}
+	g->cells[i] = (g->cells[i] & ~CELL_PATH_MASK) | INT_TO_CELL_PATH(dir);
+}
+
+
+// marks or clears the path from the spawn
+void flow_route(struct game * g, bool mark) {
+	int i = g->enemies.spawnx * height + g->enemies.spawny;
+	for (long s = 0; s < (long)width * height; s++) {
+		if (mark) g->cells[i] |= CELL_PATH;
+		else g->cells[i] &= ~CELL_PATH;
+
+		switch (CELL_PATH_TO_INT(g->cells[i])) {
+			case CELL_PATH_UP:    i--; break;
+			case CELL_PATH_DOWN:  i++; break;
+			case CELL_PATH_LEFT:  i -= height; break;
+			case CELL_PATH_RIGHT:
+				if (i / height == width - 1) return;
+				i += height;
+				break;
+		}
+	}
+}
+
+
+// repoints the cells in the log (cell, old distance pairs) and their
+// neighbours, then moves the route onto the new field
+void flow_commit(struct game * g, struct vec * log) {
+	flow_route(g, false);
+	for (int k = 0; k < log->n; k += 2) {
+		int n[4];
+		flow_neighbours(log->v[k], n);
+		flow_point(g, log->v[k]);
+		for (int j = 0; j < 4; j++) if (n[j] >= 0) flow_point(g, n[j]);
+	}
+	flow_route(g, true);
+}
+
+
+// full breadth first search from the right edge
+void flow_init(struct game * g) {
+	int * dist = flow_dist(g);
+	struct vec * q = &flow_queue;
+	q->n = 0;
+	for (int i = 0; i < width * height; i++) {
+		dist[i] = FLOW_INF;
+		if (i / height == width - 1 && !flow_blocked(g->cells[i])) {
+			dist[i] = 0;
+			vec_push(q, i);
+		}
+	}
+
+	for (int h = 0; h < q->n; h++) {
+		int u = q->v[h];
+		int n[4];
+		flow_neighbours(u, n);
+		for (int k = 0; k < 4; k++) {
+			int w = n[k];
+			if (w < 0 || dist[w] != FLOW_INF || flow_blocked(g->cells[w])) continue;
+			dist[w] = dist[u] + 1;
+			vec_push(q, w);
+		}
+	}
+
+	for (int i = 0; i < width * height; i++) flow_point(g, i);
+	flow_route(g, true);
+}
+
+
+int cmp_seed(const void * a, const void * b) {
+	return ((const int *)a)[1] - ((const int *)b)[1];
+}
+
+
+// whether the spawn and every enemy can still get out
+bool flow_open(struct game * g, int blocked) {
+	int * dist = flow_dist(g);
+	if (dist[g->enemies.spawnx * height + g->enemies.spawny] == FLOW_INF)
+		return false;
+
+	for (int e = 0; e < g->enemies.idx; e++) {
+		int i = g->enemies.enemies[e].x * height + g->enemies.enemies[e].y;
+		if (dist[i] != FLOW_INF) continue;
+		if (i != blocked && !flow_blocked(g->cells[i])) return false;
+
+		// enemies on a turret walk off it
+		int n[4];
+		flow_neighbours(i, n);
+		bool out = i / height == width - 1;
+		for (int k = 0; k < 4; k++) out |= n[k] >= 0 && dist[n[k]] != FLOW_INF;
+		if (!out) return false;
+	}
+	return true;
+}
+
+
+// blocks cell i, repairing only the distances that went through it. fails if
+// that would close the path, and only tries when commit isn't set
+bool flow_block(struct game * g, int i, bool commit) {
+	int * dist = flow_dist(g);
+	struct vec * q = &flow_queue;
+	struct vec * log = &flow_log;
+	struct vec * seeds = &flow_seeds;
+	q->n = log->n = seeds->n = 0;
+
+	vec_push(log, i);
+	vec_push(log, dist[i]);
+	vec_push(q, i);
+
+	// in order of distance, cells left without a neighbour one step closer
+	// lose their distance
+	for (int h = 0; h < q->n; h++) {
+		int u = q->v[h];
+		int d = dist[u];
+		if (d == FLOW_INF) continue;
+
+		int n[4];
+		flow_neighbours(u, n);
+		if (u != i) {
+			bool supported = d == 0;
+			for (int k = 0; k < 4; k++) {
+				supported |= n[k] >= 0 && dist[n[k]] == d - 1;
+			}
+			if (supported) continue;
+			vec_push(log, u);
+			vec_push(log, d);
+		}
+		dist[u] = FLOW_INF;
+		for (int k = 0; k < 4; k++) {
+			if (n[k] >= 0 && dist[n[k]] == d + 1) vec_push(q, n[k]);
+		}
+	}
+
+	// reconnect them from the cells around them, nearest first
+	for (int k = 2; k < log->n; k += 2) {
+		int u = log->v[k];
+		int n[4];
+		flow_neighbours(u, n);
+		int best = FLOW_INF;
+		for (int j = 0; j < 4; j++) {
+			if (n[j] >= 0 && dist[n[j]] < best) best = dist[n[j]];
+		}
+		if (best == FLOW_INF) continue;
+		vec_push(seeds, u);
+		vec_push(seeds, best + 1);
+	}
+	qsort(seeds->v, seeds->n / 2, 2 * sizeof(*seeds->v), cmp_seed);
+
+	q->n = 0;
+	int h = 0;
+	int s = 0;
+	while (h < q->n || s < seeds->n) {
+		int u, d;
+		if (h < q->n && (s == seeds->n || dist[q->v[h]] <= seeds->v[s + 1])) {
+			u = q->v[h++];
+			d = dist[u];
+		} else {
+			u = seeds->v[s];
+			d = seeds->v[s + 1];
+			s += 2;
+			if (d >= dist[u]) continue;
+			dist[u] = d;
+		}
+
+		int n[4];
+		flow_neighbours(u, n);
+		for (int k = 0; k < 4; k++) {
+			int w = n[k];
+			if (w < 0 || w == i || flow_blocked(g->cells[w])) continue;
+			if (dist[w] <= d + 1) continue;
+			dist[w] = d + 1;
+			vec_push(q, w);
+		}
+	}
+
+	bool open = flow_open(g, i);
+	if (!open || !commit) {
+		for (int k = log->n - 2; k >= 0; k -= 2) dist[log->v[k]] = log->v[k + 1];
+		return open;
+	}
+	flow_commit(g, log);
+	return true;
+}
+
+
+// unblocks cell i, spreading the distances that got shorter from it
+void flow_unblock(struct game * g, int i) {
+	int * dist = flow_dist(g);
+	struct vec * q = &flow_queue;
+	struct vec * log = &flow_log;
+	q->n = log->n = 0;
+
+	int n[4];
+	flow_neighbours(i, n);
+	int d = FLOW_INF;
+	for (int k = 0; k < 4; k++) {
+		if (n[k] >= 0 && dist[n[k]] != FLOW_INF && dist[n[k]] + 1 < d)
+			d = dist[n[k]] + 1;
+	}
+	if (i / height == width - 1) d = 0;
+	vec_push(log, i);
+	vec_push(log, dist[i]);
+	dist[i] = d;
+	if (d != FLOW_INF) vec_push(q, i);
+
+	for (int h = 0; h < q->n; h++) {
+		int u = q->v[h];
+		flow_neighbours(u, n);
+		for (int k = 0; k < 4; k++) {
+			int w = n[k];
+			if (w < 0 || flow_blocked(g->cells[w])) continue;
+			if (dist[w] <= dist[u] + 1) continue;
+			vec_push(log, w);
+			vec_push(log, dist[w]);
+			dist[w] = dist[u] + 1;
+			vec_push(q, w);
+		}
+	}
+	flow_commit(g, log);
+}
+
+
+// whether blocking (x, y) can't disconnect anything, because the open cells
+// next to it are all joined through the 8 cells around it. past the right
+// edge counts as open, since it's all the way out
+bool flow_local(struct game * g, int x, int y) {
+	static const int ring[8][2] = {
+		{0, -1}, {1, -1}, {1, 0}, {1, 1}, {0, 1}, {-1, 1}, {-1, 0}, {-1, -1},
+	};
+	bool open[8];
+	for (int k = 0; k < 8; k++) {
+		int rx = x + ring[k][0];
+		int ry = y + ring[k][1];
+		if (rx >= width) open[k] = true;
+		else if (rx < 0 || ry < 0 || ry >= height) open[k] = false;
+		else open[k] = !flow_blocked(GRID(g)[rx][ry]);
+	}
+
+	// number the runs of open cells, starting after a blocked one so that no
+	// run wraps around
+	int start = 0;
+	while (start < 8 && open[start]) start++;
+	if (start == 8) return true;
+
+	int run[8];
+	int runs = 0;
+	for (int j = 1; j <= 8; j++) {
+		int k = (start + j) % 8;
+		if (open[k] && !open[(k + 7) % 8]) runs++;
+		run[k] = runs;
+	}
+
+	// the side neighbours all have to be in the same run
+	int side = 0;
+	for (int k = 0; k < 8; k += 2) {
+		if (!open[k]) continue;
+		if (side && run[k] != side) return false;
+		side = run[k];
+	}
+	return true;
+}
+
+
+// on open maps, whether a turret on (x, y) would leave the path open
+bool flow_allows(struct game * g, int id, int x, int y) {
+	if (!open_map || turrets[id].stack >= 0) return true;
+	int i = x * height + y;
+	if (i == g->enemies.spawnx * height + g->enemies.spawny) return false;
+	if (flow_dist(g)[i] == FLOW_INF) return true;
+
+	// enemies on a turret next to it might have no other way off
+	bool local = flow_local(g, x, y);
+	for (int e = 0; local && e < g->enemies.idx; e++) {
+		int ex = g->enemies.enemies[e].x;
+		int ey = g->enemies.enemies[e].y;
+		if (abs(ex - x) + abs(ey - y) == 1 && flow_blocked(GRID(g)[ex][ey]))
+			local = false;
+	}
+	return local || flow_block(g, i, false);
+}
+
+
+bool game_can_place(struct game * g, int id, int x, int y) {
+	return can_place(GRID(g), id, x, y) && flow_allows(g, id, x, y);
+}
+
+
+char grid_getc(char grid[width][height], int x, int y) {
 	char c = grid[x][y];
 	char out = ' ';
 	if (c & CELL_TURRET) out = turrets[CELL_TURRET_TO_INT(c)].symbol;
@@ -296,7 +1050,7 @@ char grid_getc(char grid[X][Y], int x, int y) {
 }
 
 
-int grid_getcolor(char grid[X][Y], int x, int y) {
+int grid_getcolor(char grid[width][height], int x, int y) {
 	char c = grid[x][y];
 	int out = 0;
 	if (c & CELL_TURRET) out = A_UNDERLINE;
@@ -305,25 +1059,24 @@ int grid_getcolor(char grid[X][Y], int x, int y) {
 }
 
 
-void draw_grid(char grid[X][Y]) {
-	addch('+');
-	for (int x = 0; x < X; x++) addch('-');
-	addch('+');
-	addch('\n');
-	for (int y = 0; y < Y; y++) {
-		addch('|');
-		for (int x = 0; x < X; x++) {
-			int cp = grid_getcolor(grid, x, y);
-			attron(cp);
-			addch(grid_getc(grid, x, y));
-			attroff(cp);
+// draws the part of the map in view
+void draw_grid(WINDOW * w, char grid[width][height]) {
+	wmove(w, 0, 0);
+	waddch(w, '+');
+	for (int x = 0; x < view.w; x++) waddch(w, '-');
+	waddch(w, '+');
+	waddch(w, '\n');
+	for (int y = view.y; y < view.y + view.h; y++) {
+		waddch(w, '|');
+		for (int x = view.x; x < view.x + view.w; x++) {
+			waddch(w, grid_getc(grid, x, y) | grid_getcolor(grid, x, y));
 		}
-		addstr("|\n");
+		waddstr(w, "|\n");
 	}
-	addch('+');
-	for (int x = 0; x < X; x++) addch('-');
-	addch('+');
-	addch('\n');
+	waddch(w, '+');
+	for (int x = 0; x < view.w; x++) waddch(w, '-');
+	waddch(w, '+');
+	waddch(w, '\n');
 }
 
 
@@ -382,83 +1135,357 @@ void erase_shop(void) {
 }
 
 
-void draw_radius(char grid[X][Y], int x, int y, int r) {
-	attron(A_REVERSE);
-	for (int rx = -r + 1; rx < r; rx++) {
-		for (int ry = -r + 1; ry < r; ry++) {
-			if (rx*rx + ry*ry > r*r) continue;
-			int dx = rx + x;
-			int dy = ry + y;
-			if (dx < 0) dx = 0;
-			else if (dx >= X) dx = X - 1;
-			if (dy < 0) dy = 0;
-			else if (dy >= Y) dy = Y - 1;
-			move(dy + 1, dx + 1);
-			addch(grid_getc(grid, dx, dy));
-		}
-	}
-	attroff(A_REVERSE);
+/* viewport */
+
+// redraw everything on the next frame, e.g. after a menu drew over the map
+void view_invalidate(void) {
+	view.valid = false;
 }
 
 
-int try_purchase(char grid[X][Y], int id, int cash, struct turrets * spawned_turrets) {
-	int cost = turrets[id].cost;
-	int radius = turrets[id].radius;
-	if (cost > cash) return -1;
-	timeout(-1);
+// moves the view by dx, dy cells, keeping it on the map
+void view_pan(int dx, int dy) {
+	view.x += dx;
+	view.y += dy;
+	if (view.x > width - view.w) view.x = width - view.w;
+	if (view.y > height - view.h) view.y = height - view.h;
+	if (view.x < 0) view.x = 0;
+	if (view.y < 0) view.y = 0;
+	view_invalidate();
+}
 
-	bool done = false;
-	while (!done) {
-		move(Y + 2, X + 2 - 10);
-		addstr("q to abort");
-		move(Y + 3, X + 2 - 14);
-		addstr("Click to place");
-		refresh();
 
-		switch (getch()) {
-			case 'q':
-				cost = 0;
-				done = true;
-				break;
-			case KEY_MOUSE:;
-				MEVENT e;
-				if (getmouse(&e) != OK) break;
-				int x = e.x - 1;
-				int y = e.y - 1;
-				if (x < 0 || x >= X || y < 0 || y >= Y) break;
-				// turrets with a nonnegative stack must be placed on paths
-				// other turrets can only by placed on empty cells
-				if ((grid[x][y] & CELL_TURRET) ||
-				       (turrets[id].stack < 0 && (grid[x][y] & CELL_PATH))) {
-					break;
-				}
-				if (turrets[id].stack > 0 && !(grid[x][y] & CELL_PATH)) break;
+// fits the view to the terminal, leaving room for the shop and the stats
+void view_resize(void) {
+	view.w = COLS - SHOP_WIDTH - 3;
+	view.h = LINES - 7;
+	if (view.w > width) view.w = width;
+	if (view.h > height) view.h = height;
+	if (view.w < 1) view.w = 1;
+	if (view.h < 1) view.h = 1;
 
-				// draw radius
-				draw_radius(grid, x, y, radius);
-				move(e.y, e.x);
-				addch(turrets[id].symbol);
-				move(Y + 3, X + 2 - 15);
-				addstr("Enter to accept");
-				refresh();
-				if (getch() != '\n') {
-					cost = 0;
-					done = true;
-					break;
-				}
+	if (view.map) delwin(view.map);
+	view.map = newpad(view.h + 2, view.w + 3);
+	view_pan(0, 0);
+}
 
-				turrets_push(spawned_turrets, grid, x, y, id);
-				done = true;
+
+// screen position of a map cell, false if it is scrolled out of view
+bool view_cell(int x, int y, int * sx, int * sy) {
+	*sx = x - view.x + 1;
+	*sy = y - view.y + 1;
+	return x >= view.x && x < view.x + view.w &&
+	       y >= view.y && y < view.y + view.h;
+}
+
+
+// scrolls on the mouse wheel and pans by half a view on border clicks.
+// returns true with the map cell for clicks inside the view
+bool view_mouse(MEVENT * e, int * x, int * y) {
+	int dx = 0, dy = 0;
+	if (e->bstate & BUTTON4_PRESSED) dy = -VIEW_SCROLL;
+#ifdef BUTTON5_PRESSED
+	else if (e->bstate & BUTTON5_PRESSED) dy = VIEW_SCROLL;
+#endif
+	else if (!(e->bstate & BUTTON1_CLICKED)) return false;
+	else if (e->x == 0) dx = -view.w / 2;
+	else if (e->x == view.w + 1) dx = view.w / 2;
+	else if (e->y == 0) dy = -view.h / 2;
+	else if (e->y == view.h + 1) dy = view.h / 2;
+
+	if (e->bstate & BUTTON_SHIFT) {
+		dx = dy;
+		dy = 0;
+	}
+	if (dx || dy) {
+		view_pan(dx, dy);
+		return false;
+	}
+
+	if (e->x < 1 || e->x > view.w || e->y < 1 || e->y > view.h) return false;
+	*x = e->x - 1 + view.x;
+	*y = e->y - 1 + view.y;
+	return true;
+}
+
+
+// pans on the arrow and page keys, returns false for any other key
+bool view_key(int c) {
+	switch (c) {
+		case KEY_LEFT:  view_pan(-VIEW_SCROLL, 0); break;
+		case KEY_RIGHT: view_pan(VIEW_SCROLL, 0); break;
+		case KEY_UP:    view_pan(0, -VIEW_SCROLL); break;
+		case KEY_DOWN:  view_pan(0, VIEW_SCROLL); break;
+		case KEY_PPAGE: view_pan(0, -view.h); break;
+		case KEY_NPAGE: view_pan(0, view.h); break;
+		case KEY_RESIZE: view_resize(); break;
+		default: return false;
+	}
+	return true;
+}
+
+
+void draw_enemies(struct enemies * enemies) {
+	view.n = 0;
+	for (int i = 0; i < enemies->idx; i++) {
+		if (enemies->enemies[i].count == 0) continue;
+		int x, y;
+		if (!view_cell(enemies->enemies[i].x, enemies->enemies[i].y, &x, &y))
+			continue;
+		int cp = 0;
+		switch (enemies->enemies[i].count) {
+			case 1: cp = COLOR_PAIR(RED); break;
+			case 2: cp = COLOR_PAIR(CYAN); break;
+			case 3: cp = COLOR_PAIR(GREEN); break;
+			case 4: cp = COLOR_PAIR(YELLOW); break;
+			default: cp = COLOR_PAIR(MAGENTA); break;
+		}
+		// groups stand out
+		if (enemies->enemies[i].n) cp |= A_BOLD;
+		move(y, x);
+		attron(cp);
+		addch('@');
+		attroff(cp);
+		view.ex[view.n] = x;
+		view.ey[view.n] = y;
+		view.n++;
+	}
+}
+
+
+void draw_map(struct game * g) {
+	if (!view.map) view_resize();
+
+	bool rendered = false;
+	if (!view.valid || view.changes != g->spawned_turrets.changes) {
+		draw_grid(view.map, GRID(g));
+		view.changes = g->spawned_turrets.changes;
+		rendered = true;
+	}
+
+	if (!view.valid) erase();
+	if (rendered) {
+		copywin(view.map, stdscr, 0, 0, 0, 0, view.h + 1, view.w + 1, FALSE);
+	} else for (int i = 0; i < view.n; i++) {
+		// only the cells enemies were on last frame need restoring
+		int x = view.ex[i];
+		int y = view.ey[i];
+		mvaddch(y, x, mvwinch(view.map, y, x));
+	}
+	view.valid = true;
+
+	draw_enemies(&g->enemies);
+}
+
+
+void draw_game(struct game * g) {
+	draw_map(g);
+	draw_shop(g->cash);
+	move(view.h + 2, 0);
+	printw("Round: %d\n", g->round);
+	printw("Lives: %d\n", g->lives);
+	printw("Cash: %d\n", g->cash);
+	printw("Score: %d\n", g->score);
+	if (view.w < width || view.h < height) {
+		printw("View: %d,%d of %dx%d\n", view.x, view.y, width, height);
+	}
+}
+
+
+void draw_radius(char grid[width][height], int x, int y, int r) {
+	attron(A_REVERSE);
+	for (int rx = -r + 1; rx < r; rx++) {
+		for (int ry = -r + 1; ry < r; ry++) {
+			if (rx*rx + ry*ry > r*r) continue;
+			int dx = rx + x;
+			int dy = ry + y;
+			int sx, sy;
+			if (dx < 0 || dx >= width || dy < 0 || dy >= height) continue;
+			if (!view_cell(dx, dy, &sx, &sy)) continue;
+			move(sy, sx);
+			addch(grid_getc(grid, dx, dy));
+		}
+	}
+	attroff(A_REVERSE);
+}
+
+
+/* coverage heatmap */
+
+// rows dy0..dy1 of a circle that all span -hw..hw
+struct band {
+	int dy0, dy1, hw;
+};
+
+
+// splits the circle of radius r into bands, at most 2r + 1 of them
+int circle_bands(int r, struct band * b) {
+	int n = 0;
+	for (int dy = -r; dy <= r; dy++) {
+		int hw = 0;
+		while ((hw + 1)*(hw + 1) + dy*dy <= r*r) hw++;
+		if (n && b[n - 1].hw == hw) b[n - 1].dy1 = dy;
+		else b[n++] = (struct band){dy, dy, hw};
+	}
+	return n;
+}
+
+
+// path cells within the circle around cell (i, j) of a summed-area table,
+// one rectangle per band
+int band_sum(int h, int sum[][h + 1], struct band * b, int n, int i, int j) {
+	int total = 0;
+	for (int k = 0; k < n; k++) {
+		int x0 = i - b[k].hw, x1 = i + b[k].hw + 1;
+		int y0 = j + b[k].dy0, y1 = j + b[k].dy1 + 1;
+		total += sum[x1][y1] - sum[x0][y1] - sum[x1][y0] + sum[x0][y0];
+	}
+	return total;
+}
+
+
+// shades the free cells in view by how many path cells a turret placed there
+// would have in range, relative to the best cell in view
+void draw_heat(struct game * g, int id) {
+	static const char ramp[] = ".:+*#";
+	static const int colors[] = {BLUE, CYAN, GREEN, YELLOW, RED};
+
+	int r = turrets[id].radius;
+	if (r <= 0) return;
+	char (* grid)[height] = GRID(g);
+
+	// sum[i][j] counts the path cells in [x0, x0 + i) x [y0, y0 + j), over
+	// the view and everything in range of it
+	int x0 = view.x - r, y0 = view.y - r;
+	int w = view.w + 2 * r, h = view.h + 2 * r;
+	int (* sum)[h + 1] = (int (*)[h + 1])view.heat.sum;
+
+	struct band b[2 * r + 1];
+	int n = circle_bands(r, b);
+
+	if (!sum || view.heat.x != x0 || view.heat.y != y0 || view.heat.w != w ||
+	    view.heat.h != h || view.heat.r != r ||
+	    view.heat.changes != g->spawned_turrets.changes) {
+		if (view.heat.w != w || view.heat.h != h) {
+			free(view.heat.sum);
+			view.heat.sum = malloc((size_t)(w + 1) * (h + 1) * sizeof(int));
+			sum = (int (*)[h + 1])view.heat.sum;
+		}
+		for (int j = 0; j <= h; j++) sum[0][j] = 0;
+		for (int i = 0; i < w; i++) {
+			int x = x0 + i;
+			bool in = x >= 0 && x < width;
+			sum[i + 1][0] = 0;
+			for (int j = 0; j < h; j++) {
+				int y = y0 + j;
+				int path = in && y >= 0 && y < height && (grid[x][y] & CELL_PATH);
+				sum[i + 1][j + 1] = sum[i][j + 1] + sum[i + 1][j] - sum[i][j] + path;
+			}
+		}
+
+		int best = 0;
+		for (int x = view.x; x < view.x + view.w; x++) {
+			for (int y = view.y; y < view.y + view.h; y++) {
+				if (!can_place(grid, id, x, y)) continue;
+				int c = band_sum(h, sum, b, n, x - x0, y - y0);
+				if (c > best) best = c;
+			}
+		}
+
+		view.heat.x = x0;
+		view.heat.y = y0;
+		view.heat.w = w;
+		view.heat.h = h;
+		view.heat.r = r;
+		view.heat.changes = g->spawned_turrets.changes;
+		view.heat.best = best;
+	}
+	int best = view.heat.best;
+
+	for (int x = view.x; x < view.x + view.w && best; x++) {
+		for (int y = view.y; y < view.y + view.h; y++) {
+			if (!can_place(grid, id, x, y)) continue;
+			int sx, sy;
+			view_cell(x, y, &sx, &sy);
+			// leave the path and enemies visible
+			if ((mvinch(sy, sx) & A_CHARTEXT) != ' ') continue;
+			int c = band_sum(h, sum, b, n, x - x0, y - y0);
+			if (!c) continue;
+			int level = (c * ARRLEN(colors) - 1) / best;
+			attron(COLOR_PAIR(colors[level]));
+			addch(ramp[level]);
+			attroff(COLOR_PAIR(colors[level]));
+		}
+	}
+}
+
+
+// drops draw_heat()'s table when another game takes over the view, since its
+// turret changes are counted separately
+void heat_invalidate(void) {
+	view.heat.r = 0;
+}
+
+
+// returns -1 if the turret can't be afforded, 0 if the purchase was aborted,
+// and 1 if a cell was chosen (stored into px, py)
+int try_purchase(struct game * g, int id, int * px, int * py) {
+	int radius = turrets[id].radius;
+	if (turrets[id].cost > g->cash) return -1;
+	timeout(-1);
+
+	int ret = 0;
+	bool done = false;
+	while (!done) {
+		if (!view.valid) {
+			draw_game(g);
+			draw_heat(g, id);
+		}
+		move(view.h + 2, view.w + 2 - 10);
+		addstr("q to abort");
+		move(view.h + 3, view.w + 2 - 14);
+		addstr("Click to place");
+		refresh();
+
+		int c = getch();
+		if (view_key(c)) continue;
+		switch (c) {
+			case 'q':
+				done = true;
+				break;
+			case KEY_MOUSE:;
+				MEVENT e;
+				int x, y;
+				if (getmouse(&e) != OK || !view_mouse(&e, &x, &y)) break;
+				if (!game_can_place(g, id, x, y)) break;
+
+				// draw radius
+				draw_radius(GRID(g), x, y, radius);
+				move(e.y, e.x);
+				addch(turrets[id].symbol);
+				move(view.h + 3, view.w + 2 - 15);
+				addstr("Enter to accept");
+				refresh();
+				if (getch() != '\n') {
+					done = true;
+					break;
+				}
+
+				*px = x;
+				*py = y;
+				ret = 1;
+				done = true;
 				break;
 		}
 	}
 
 	timeout(DELAY);
-	return cost;
+	return ret;
 }
 
 
-int try_upgrade(int id, int cash, struct turrets * spawned_turrets, char grid[X][Y]) {
+enum action try_upgrade(int id, int cash, struct turrets * spawned_turrets, char grid[width][height]) {
+	enum action action = ACTION_NONE;
 	int cost = 0;
 	timeout(-1);
 
@@ -483,18 +1510,7 @@ int try_upgrade(int id, int cash, struct turrets * spawned_turrets, char grid[X]
 	int max_level = turrets[tid].n_upgrades;
 	int cur_level = st->level;
 	int up_idx = cur_level;
-	// sell for 75% of purchasing cost
-	int selling = 0;
-	selling += turrets[tid].cost;
-	for (int i = 0; i < cur_level; i++) {
-		selling += turrets[tid].upgrades[i].cost;
-	}
-	if (turrets[tid].stack > 0) {
-		selling *= st->stack;
-		selling /= turrets[tid].stack;
-	}
-	selling *= 3;
-	selling /= 4;
+	int selling = sell_value(st);
 	move(SHOP_ID_TO_Y(1), SHOP_ID_TO_X(1));
 	attron(A_REVERSE);
 	printw("Sell: -$%d", selling);
@@ -516,10 +1532,10 @@ int try_upgrade(int id, int cash, struct turrets * spawned_turrets, char grid[X]
 
 	bool done = false;
 	while (!done) {
-		move(Y + 2, X + 2 - 12);
+		move(view.h + 2, view.w + 2 - 12);
 		addstr("Any to abort");
 		// clear the pause/resume prompt
-		move(Y + 3, X + 2 - 14);
+		move(view.h + 3, view.w + 2 - 14);
 		clrtoeol();
 		refresh();
 
@@ -527,9 +1543,8 @@ int try_upgrade(int id, int cash, struct turrets * spawned_turrets, char grid[X]
 			case KEY_MOUSE:;
 				MEVENT e;
 				if (getmouse(&e) != OK) break;
-				int x = e.x - 1;
-				int y = e.y - 1;
-				int sid = yx_to_shop_id(e.y, e.x);
+				int sid = -1;
+				if (e.bstate & BUTTON1_CLICKED) sid = yx_to_shop_id(e.y, e.x);
 				// turret info
 				if (sid == 0) {
 					int kills = st->kills;
@@ -562,78 +1577,214 @@ int try_upgrade(int id, int cash, struct turrets * spawned_turrets, char grid[X]
 						mvprintw(++py, px, "Stacked: %d", stk);
 					}
 
-					move(Y + 2, X + 2 - 13);
+					move(view.h + 2, view.w + 2 - 13);
 					addstr("Any to finish");
 					refresh();
 					getch();
 					done = true;
-					cost = 0;
 					break;
 				// sell turret
 				} else if (sid == 1) {
-					cost = -selling;
+					action = ACTION_SELL;
 					done = true;
 				// upgrade turret
 				} else if (sid == 2) {
-					if (cash < cost) break;
-					st->level++;
-					st->radius = turrets[tid].upgrades[up_idx].radius;
-					st->rsplash = turrets[tid].upgrades[up_idx].rsplash;
-					st->damage = turrets[tid].upgrades[up_idx].damage;
-					st->dsplash = turrets[tid].upgrades[up_idx].dsplash;
-					st->ticks = turrets[tid].upgrades[up_idx].ticks;
+					if (cur_level >= max_level || cash < cost) break;
+					action = ACTION_UPGRADE;
 					done = true;
 					break;
 				}
 				break;
 			default:
-				cost = 0;
 				done = true;
 				break;
 		}
 	}
 
 	timeout(DELAY);
-	return cost;
+	return action;
 }
 
 
-void draw_enemies(struct enemies * enemies) {
-	for (int i = 0; i < enemies->idx; i++) {
-		if (enemies->enemies[i].count == 0) continue;
-		int cp = 0;
-		switch (enemies->enemies[i].count) {
-			case 1: cp = COLOR_PAIR(RED); break;
-			case 2: cp = COLOR_PAIR(CYAN); break;
-			case 3: cp = COLOR_PAIR(GREEN); break;
-			case 4: cp = COLOR_PAIR(YELLOW); break;
-			default: cp = COLOR_PAIR(MAGENTA); break;
+/* profiler */
+
+enum prof_phase {
+	PROF_SPAWN,   // spawn_enemies()
+	PROF_TURRETS, // run_turrets(), without attack animations
+	PROF_TARGET,  // find_nearest_enemy(), part of PROF_TURRETS
+	PROF_DRAW,    // drawing the frame and attack animations
+	PROF_PHASES,
+};
+
+char * prof_names[PROF_PHASES] = {
+	[PROF_SPAWN] = "spawn",
+	[PROF_TURRETS] = "turrets",
+	[PROF_TARGET] = "target",
+	[PROF_DRAW] = "draw",
+};
+
+
+// the time spent in each phase of a frame
+struct prof_sample {
+	unsigned long tick;
+	uint64_t start[PROF_PHASES]; // ns, when the phase first ran this frame
+	uint64_t dur[PROF_PHASES];   // ns
+	int calls[PROF_PHASES];
+	int enemies;
+	int turrets;
+	long dropped;
+};
+
+
+// the last PROF_SAMPLES frames, off unless playing interactively
+struct {
+	bool on;
+	bool overlay;
+	long n; // frames recorded so far
+	struct prof_sample samples[PROF_SAMPLES];
+} prof;
+
+
+uint64_t prof_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+struct prof_sample * prof_cur(void) {
+	return &prof.samples[(prof.n - 1) % PROF_SAMPLES];
+}
+
+
+void prof_frame(struct game * g) {
+	if (!prof.on) return;
+	prof.n++;
+	struct prof_sample * s = prof_cur();
+	memset(s, 0, sizeof(*s));
+	s->tick = g->ticks;
+	s->enemies = g->enemies.idx;
+	s->turrets = g->spawned_turrets.idx;
+	s->dropped = g->enemies.dropped;
+}
+
+
+uint64_t prof_begin(void) {
+	return prof.on ? prof_now() : 0;
+}
+
+
+void prof_end(enum prof_phase p, uint64_t start) {
+	if (!prof.on || prof.n == 0) return;
+	struct prof_sample * s = prof_cur();
+	if (s->calls[p]++ == 0) s->start[p] = start;
+	s->dur[p] += prof_now() - start;
+}
+
+
+void prof_skip(enum prof_phase p, uint64_t ns) {
+	if (prof.on && prof.n) prof_cur()->dur[p] -= ns;
+}
+
+
+uint64_t prof_total(enum prof_phase p) {
+	return prof.on && prof.n ? prof_cur()->dur[p] : 0;
+}
+
+
+int cmp_u64(const void * a, const void * b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+
+// p50 and p99 of every phase over the recorded frames, beside the map
+void draw_profile(void) {
+	int n = prof.n < PROF_SAMPLES ? prof.n : PROF_SAMPLES;
+	if (n == 0) return;
+
+	int y = SHOP_ID_TO_Y(ARRLEN(turrets));
+	int x = SHOP_STARTX;
+	mvprintw(y++, x, "%-8s%7s%7s", "Phase", "p50us", "p99us");
+	uint64_t durs[PROF_SAMPLES];
+	for (int p = 0; p < PROF_PHASES; p++) {
+		for (int i = 0; i < n; i++) durs[i] = prof.samples[i].dur[p];
+		qsort(durs, n, sizeof(*durs), cmp_u64);
+		mvprintw(y++, x, "%-8s%7.1f%7.1f", prof_names[p],
+		         durs[n / 2] / 1e3, durs[n * 99 / 100] / 1e3);
+	}
+	struct prof_sample * s = prof_cur();
+	mvprintw(y++, x, "Enemies %d", s->enemies);
+	mvprintw(y++, x, "Turrets %d", s->turrets);
+	if (s->dropped) mvprintw(y++, x, "Turned away %ld", s->dropped);
+}
+
+
+// the recorded frames in Chrome's trace event format
+bool prof_dump(char * path) {
+	FILE * fp = fopen(path, "w");
+	if (!fp) return false;
+
+	long first = prof.n > PROF_SAMPLES ? prof.n - PROF_SAMPLES : 0;
+	fputs("{\"traceEvents\":[\n", fp);
+	bool comma = false;
+	for (long f = first; f < prof.n; f++) {
+		struct prof_sample * s = &prof.samples[f % PROF_SAMPLES];
+		for (int p = 0; p < PROF_PHASES; p++) {
+			if (s->calls[p] == 0) continue;
+			fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":0,"
+			        "\"ts\":%.3f,\"dur\":%.3f,"
+			        "\"args\":{\"tick\":%lu,\"calls\":%d}}",
+			        comma ? ",\n" : "", prof_names[p], s->start[p] / 1e3,
+			        s->dur[p] / 1e3, s->tick, s->calls[p]);
+			comma = true;
 		}
-		int x = enemies->enemies[i].x;
-		int y = enemies->enemies[i].y;
-		move(1 + y, 1 + x);
-		attron(cp);
-		addch('@');
-		attroff(cp);
+		uint64_t ts = s->calls[PROF_DRAW] ? s->start[PROF_DRAW] : s->start[0];
+		fprintf(fp, "%s{\"name\":\"entities\",\"ph\":\"C\",\"pid\":0,"
+		        "\"ts\":%.3f,\"args\":{\"enemies\":%d,\"turrets\":%d}}",
+		        comma ? ",\n" : "", ts / 1e3, s->enemies, s->turrets);
+		comma = true;
+	}
+	fputs("\n]}\n", fp);
+	return fclose(fp) == 0;
+}
+
+
+// p toggles the overlay and t dumps a trace, returns false for any other key
+bool prof_key(int c) {
+	if (c == 'p') {
+		prof.overlay = !prof.overlay;
+		return true;
 	}
+	if (c != 't') return false;
+
+	bool dumped = prof_dump(TRACE_FILE);
+	move(view.h/2 + 1, view.w/2 + 1 - 8);
+	attron(A_REVERSE);
+	addstr(dumped ? " Trace saved " : " Trace failed ");
+	attroff(A_REVERSE);
+	refresh();
+	napms(500);
+	return true;
 }
 
 
-int get_spawn_rate(int round) {
+int get_spawn_rate(uint64_t * rng, int round) {
 	if (round <= 10) return 5;
-	if (round <= 35) return rand_range(2,4);
-	return rand_range(1, 4);
+	if (round <= 35) return rand_range(rng, 2,4);
+	return rand_range(rng, 1, 4);
 }
 
 
-int get_speed(int round) {
+int get_speed(uint64_t * rng, int round) {
 	if (round <= 10) return 5;
-	if (round <= 35) return rand_range(3, 5);
-	return rand_range(1, 3);
+	if (round <= 35) return rand_range(rng, 3, 5);
+	return rand_range(rng, 1, 3);
 }
 
 
-int get_stack(int round) {
+int get_stack(uint64_t * rng, int round) {
 	int lower_rounds[] = {
 		1, 1, 1, 2, 2,
 	};
@@ -648,42 +1799,57 @@ int get_stack(int round) {
 		4, 4, 4, 4, 4, 4, 4, 5, 5,
 		5, 5, 6, 6, 6, 7, 7, 8, 9
 	};
-	if (round <= 10) return lower_rounds[rand_range(0, ARRLEN(lower_rounds))];
-	if (round <= 35) return mid_rounds[rand_range(0, ARRLEN(mid_rounds))];
-	if (round <= 60) return mid_rounds2[rand_range(0, ARRLEN(mid_rounds2))];
-	return rand_range(5, 20);
+	if (round <= 10) return lower_rounds[rand_range(rng, 0, ARRLEN(lower_rounds))];
+	if (round <= 35) return mid_rounds[rand_range(rng, 0, ARRLEN(mid_rounds))];
+	if (round <= 60) return mid_rounds2[rand_range(rng, 0, ARRLEN(mid_rounds2))];
+	return rand_range(rng, 5, 20);
 }
 
 
-int get_to_spawn(int round) {
-	int ret = 0;
-	if (round <= 3) ret = (round + 1) * 4 + rand_range(0, 2);
-	else if (round <= 20) ret = round * 3 + rand_range(0, 5);
-	else if (round <= 40) ret = 2 * MAX_ENEMIES / 3 + rand_range(-5, 5);
-	else ret =  7 * MAX_ENEMIES / 8 + rand_range(-5, 5);
-	return ret > MAX_ENEMIES - 20 ? MAX_ENEMIES - 20 : ret;
+// enemies in a wave, counting each one's stack. past round 41 waves grow by a
+// tenth every round, up to MAX_WAVE
+int get_to_spawn(uint64_t * rng, int round) {
+	if (round <= 3) return (round + 1) * 4 + rand_range(rng, 0, 2);
+	if (round <= 20) return round * 3 + rand_range(rng, 0, 5);
+	if (round <= 40) return WAVE_MID + rand_range(rng, -5, 5);
+
+	int ret = WAVE_LATE;
+	for (int r = 41; r < round && ret < MAX_WAVE; r++) ret += ret / 10;
+	return ret + rand_range(rng, -5, 5);
+}
+
+
+// enemies spawned at once, so that big waves come out as fast as small ones
+int get_batch(int to_spawn) {
+	return 1 + to_spawn / WAVE_BATCH;
 }
 
 
-int spawn_enemies(struct enemies * enemies, char grid[X][Y], int round) {
+int spawn_enemies(
+	struct enemies * enemies, char grid[width][height], int round,
+	unsigned long ticks, uint64_t * rng
+) {
 	if (enemies->last_round != round) {
 		enemies->spawned = 0;
 		enemies->killed = 0;
 		enemies->last_round = round;
-		enemies->to_spawn = get_to_spawn(round);
+		enemies->to_spawn = get_to_spawn(rng, round);
 	}
 
 	int deaths = 0;
-	
-	// advance all enemies
+
+	// advance the enemies due to move this tick
 	// iterate backward so that popping doesn't mess up the iteration
-	for (int i = enemies->idx - 1; i >= 0; i--) {
+	int due[MAX_ENEMIES];
+	int n = sched_due(&enemies->sched, enemies->order, ticks, due);
+	for (int k = n - 1; k >= 0; k--) {
+		int i = due[k];
 		if (enemies->enemies[i].count == 0) continue;
-		if (ticks % enemies->enemies[i].ticks != 0) continue;
 		int x = enemies->enemies[i].x;
 		int y = enemies->enemies[i].y;
 		int c = grid[x][y];
-		if (c & CELL_PATH) switch (CELL_PATH_TO_INT(c)) {
+		// on open maps every cell points the way out
+		if ((c & CELL_PATH) || open_map) switch (CELL_PATH_TO_INT(c)) {
 			case CELL_PATH_UP:    y--; break;
 			case CELL_PATH_DOWN:  y++; break;
 			case CELL_PATH_LEFT:  x--; break;
@@ -691,34 +1857,167 @@ int spawn_enemies(struct enemies * enemies, char grid[X][Y], int round) {
 		}
 		enemies->enemies[i].x = x;
 		enemies->enemies[i].y = y;
-		if (x >= X || y >= Y) {
-			enemies->killed += enemies->enemies[i].count;
-			deaths += enemies->enemies[i].count;
+		if (x >= width || y >= height) {
+			int units = enemy_units(&enemies->enemies[i]);
+			enemies->killed += units;
+			deaths += units;
 			enemies_pop(enemies, i);
 		}
 	}
 
 	if (enemies->spawned >= enemies->to_spawn) return deaths;
 
-	int spawn_rate = get_spawn_rate(round);
-	int speed = get_speed(round);
-	int stack = get_stack(round);
+	int spawn_rate = get_spawn_rate(rng, round);
+	int speed = get_speed(rng, round);
+	int stack = get_stack(rng, round);
 	if (ticks % spawn_rate == 0) {
-		enemies_push(enemies, enemies->spawnx, enemies->spawny, stack, speed);
+		enemies_push(enemies, enemies->spawnx, enemies->spawny, stack, speed,
+		             get_batch(enemies->to_spawn));
 	}
 
 	return deaths;
 }
 
 
+// a parallel_for() call being worked through
+struct job {
+	void (* fn)(void * ctx, int i);
+	void * ctx;
+	int n;
+
+	int next;         // next index to hand out
+	int left;         // indices not finished yet
+	struct job * link;
+};
+
+
+// threads started once and shared by every parallel_for() call. calls can
+// come from the workers themselves, like a batch game finding its targets, so
+// the newest job is handed out first
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work; // a job was posted, or the pool is stopping
+	pthread_cond_t done; // a job's last index finished
+	struct job * jobs;   // the jobs with indices left to hand out
+	bool stop;
+
+	pthread_t * threads;
+	int n;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+
+// runs the next index of job j, unlocking the pool while it runs
+void job_step(struct job * j) {
+	int i = j->next++;
+	if (j->next == j->n) {
+		struct job ** p = &pool.jobs;
+		while (*p != j) p = &(*p)->link;
+		*p = j->link;
+	}
+
+	pthread_mutex_unlock(&pool.lock);
+	j->fn(j->ctx, i);
+	pthread_mutex_lock(&pool.lock);
+
+	if (--j->left == 0) pthread_cond_broadcast(&pool.done);
+}
+
+
+void * pool_worker(void * arg) {
+	pthread_mutex_lock(&pool.lock);
+	while (true) {
+		while (!pool.jobs && !pool.stop) pthread_cond_wait(&pool.work, &pool.lock);
+		if (!pool.jobs) break;
+		job_step(pool.jobs);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	flow_scratch_free();
+	return NULL;
+}
+
+
+void pool_stop(void) {
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = true;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (int i = 0; i < pool.n; i++) pthread_join(pool.threads[i], NULL);
+	free(pool.threads);
+	pool.threads = NULL;
+	pool.n = 0;
+}
+
+
+// starts the workers, which are joined at exit. the thread calling
+// parallel_for() works too, so this is one less than the threads to use
+void pool_start(int workers) {
+	if (workers < 1 || pool.n) return;
+	pool.threads = malloc(workers * sizeof(*pool.threads));
+	for (int i = 0; i < workers; i++) {
+		pthread_create(&pool.threads[i], NULL, pool_worker, NULL);
+	}
+	pool.n = workers;
+	atexit(pool_stop);
+}
+
+
+// calls fn(ctx, i) for every i in [0, n) across the pool, returning once
+// they're all done
+void parallel_for(int n, void (* fn)(void *, int), void * ctx) {
+	if (n < 1) return;
+	struct job j = {
+		.fn = fn,
+		.ctx = ctx,
+		.n = n,
+		.left = n,
+	};
+
+	pthread_mutex_lock(&pool.lock);
+	j.link = pool.jobs;
+	pool.jobs = &j;
+	if (n > 1) pthread_cond_broadcast(&pool.work);
+	while (j.next < j.n) job_step(&j);
+	while (j.left > 0) pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+
 int find_nearest_enemy(struct enemies * enemies, int x, int y, int rad) {
 	if (enemies->idx == 0) return -1;
 
-	int nearestx = X + 1;
-	int nearesty = Y + 1;
+	int nearestx = width + 1;
+	int nearesty = height + 1;
+	int nearestid = -1;
+
+	for (int i = 0; i < enemies->idx; i++) {
+		int ex = enemies->enemies[i].x - x;
+		int ey = enemies->enemies[i].y - y;
+		if (ex*ex + ey*ey > rad*rad) continue;
+		if (ex*ex + ey*ey < nearestx*nearestx + nearesty*nearesty) {
+			nearestx = ex;
+			nearesty = ey;
+			nearestid = i;
+		}
+	}
+
+	return nearestid;
+}
+
+
+// find_nearest_enemy(), skipping enemies killed earlier in the tick. kept
+// apart since the extra check slows down the common scan
+int find_nearest_alive(struct enemies * enemies, int x, int y, int rad) {
+	int nearestx = width + 1;
+	int nearesty = height + 1;
 	int nearestid = -1;
 
 	for (int i = 0; i < enemies->idx; i++) {
+		if (enemies->enemies[i].count == 0) continue;
 		int ex = enemies->enemies[i].x - x;
 		int ey = enemies->enemies[i].y - y;
 		if (ex*ex + ey*ey > rad*rad) continue;
@@ -733,11 +2032,18 @@ int find_nearest_enemy(struct enemies * enemies, int x, int y, int rad) {
 }
 
 
+// hits the enemy in front of group id, the next one steps up if it dies.
+// killed groups are left with a count of 0 until enemies_compact()
 int attack_enemy(struct enemies * enemies, int id, int dmg) {
-	int kills = enemies->enemies[id].count;
-	enemies->enemies[id].count -= dmg;
+	struct enemy * e = &enemies->enemies[id];
+	int kills = e->count;
+	e->count -= dmg;
 	if (dmg >= kills) {
-		enemies_pop(enemies, id);
+		e->count = 0;
+		if (e->n > 0) {
+			e->n--;
+			e->count = e->stack;
+		}
 	} else kills = dmg;
 	enemies->killed += kills;
 	return kills;
@@ -746,11 +2052,22 @@ int attack_enemy(struct enemies * enemies, int id, int dmg) {
 
 int splash_enemies(struct enemies * enemies, int x, int y, int rad, int dmg) {
 	int kills = 0;
+	// enemies killed earlier in the tick are hit for nothing
 	for (int i = 0; i < enemies->idx; i++) {
 		int ex = enemies->enemies[i].x - x;
 		int ey = enemies->enemies[i].y - y;
 		if (ex*ex + ey*ey > rad*rad) continue;
 
+		// the whole group is hit, the ones behind first so that the next one
+		// steps up already damaged
+		struct enemy * e = &enemies->enemies[i];
+		if (e->n > 0) {
+			int hit = dmg < e->stack ? dmg : e->stack;
+			kills += e->n * hit;
+			enemies->killed += e->n * hit;
+			e->stack -= hit;
+			if (e->stack == 0) e->n = 0;
+		}
 		kills += attack_enemy(enemies, i, dmg);
 	}
 
@@ -758,11 +2075,50 @@ int splash_enemies(struct enemies * enemies, int x, int y, int rad, int dmg) {
 }
 
 
-int run_turrets(struct turrets * spawned, struct enemies * enemies, char grid[X][Y]) {
+// the due turrets' targets, found against the enemies as they were before any
+// turret attacked this tick
+struct targeting {
+	struct turrets * spawned;
+	struct enemies * enemies;
+	int * due;
+	int n;
+	int * targets;
+};
+
+
+void find_targets(void * ctx, int c) {
+	struct targeting * t = ctx;
+	int end = (c + 1) * TARGET_CHUNK;
+	if (end > t->n) end = t->n;
+	for (int k = c * TARGET_CHUNK; k < end; k++) {
+		struct spawned_turret * st = &t->spawned->spawned[t->due[k]];
+		t->targets[k] = find_nearest_enemy(t->enemies, st->x, st->y, st->radius);
+	}
+}
+
+
+int run_turrets(
+	struct turrets * spawned, struct enemies * enemies, char grid[width][height],
+	unsigned long ticks
+) {
 	int kills = 0;
 
-	for (int i = 0; i < spawned->idx; i++) {
-		int tid = spawned->spawned[i].id;
+	int due[MAX_TURRETS];
+	int targets[MAX_TURRETS];
+	int n = sched_due(&spawned->sched, spawned->order, ticks, due);
+
+	// enemies only get killed, so a target that is still alive when its
+	// turret's turn comes is still the nearest; the others are looked up again
+	uint64_t start = prof_begin();
+	struct targeting t = {spawned, enemies, due, n, targets};
+	int chunks = (n + TARGET_CHUNK - 1) / TARGET_CHUNK;
+	if (parallel_targets && (long)n * enemies->idx >= TARGET_PARALLEL_WORK) {
+		parallel_for(chunks, find_targets, &t);
+	} else for (int c = 0; c < chunks; c++) find_targets(&t, c);
+	prof_end(PROF_TARGET, start);
+
+	for (int k = 0; k < n; k++) {
+		int i = due[k];
 		int tx = spawned->spawned[i].x;
 		int ty = spawned->spawned[i].y;
 		int radius = spawned->spawned[i].radius;
@@ -770,22 +2126,31 @@ int run_turrets(struct turrets * spawned, struct enemies * enemies, char grid[X]
 		int rsplash = spawned->spawned[i].rsplash;
 		int dsplash = spawned->spawned[i].dsplash;
 
-		if (ticks % spawned->spawned[i].ticks != 0) continue;
-
-		int nearest = find_nearest_enemy(enemies, tx, ty, radius);
+		int nearest = targets[k];
+		if (nearest >= 0 && enemies->enemies[nearest].count == 0) {
+			start = prof_begin();
+			nearest = find_nearest_alive(enemies, tx, ty, radius);
+			prof_end(PROF_TARGET, start);
+		}
 		if (nearest < 0) continue;
 
 		int nx = enemies->enemies[nearest].x;
 		int ny = enemies->enemies[nearest].y;
 
 		// damage animation
-		move(ny + 1, nx + 1);
-		attron(A_REVERSE);
-		addch(grid_getc(grid, nx, ny));
-		refresh();
-		napms(ATTACK_ANIMATION_DELAY);
-		attroff(A_REVERSE);
-		refresh();
+		int sx, sy;
+		if (!headless && view_cell(nx, ny, &sx, &sy)) {
+			start = prof_begin();
+			move(sy, sx);
+			attron(A_REVERSE);
+			addch(grid_getc(grid, nx, ny));
+			refresh();
+			napms(ATTACK_ANIMATION_DELAY);
+			attroff(A_REVERSE);
+			mvaddch(sy, sx, grid_getc(grid, nx, ny) | grid_getcolor(grid, nx, ny));
+			refresh();
+			prof_end(PROF_DRAW, start);
+		}
 
 		int just_killed = attack_enemy(enemies, nearest, damage);
 		if (rsplash > 0 && dsplash > 0)
@@ -796,12 +2161,16 @@ int run_turrets(struct turrets * spawned, struct enemies * enemies, char grid[X]
 			spawned->spawned[i].stack -= just_killed;
 			if (spawned->spawned[i].stack <= 0) {
 				turrets_pop(spawned, grid, tx, ty, i);
+				// the turrets after it moved down
+				for (int j = k + 1; j < n; j++) due[j]--;
+				continue;
 			}
 		}
 
 		spawned->spawned[i].kills += just_killed;
 	}
 
+	enemies_compact(enemies);
 	return kills;
 }
 
@@ -811,16 +2180,1361 @@ bool no_enemies(struct enemies * enemies) {
 }
 
 
-int main(void) {
-	srand(SEED);
 
+void game_init(struct game * g, uint64_t seed) {
+	memset(g, 0, game_size());
+	g->cash = STARTING_CASH;
+	g->lives = STARTING_LIVES;
+	g->round = STARTING_ROUND;
+	g->rng = seed;
+
+	generate_path(GRID(g), &g->enemies, &g->rng);
+	if (open_map) flow_init(g);
+}
+
+
+void game_tick(struct game * g) {
+	uint64_t start = prof_begin();
+	int deaths = spawn_enemies(&g->enemies, GRID(g), g->round, g->ticks, &g->rng);
+	prof_end(PROF_SPAWN, start);
+	g->lives -= deaths;
+
+	if (no_enemies(&g->enemies)) {
+		g->round++;
+	}
+
+	start = prof_begin();
+	uint64_t drawn = prof_total(PROF_DRAW);
+	int killed = run_turrets(&g->spawned_turrets, &g->enemies, GRID(g), g->ticks);
+	prof_end(PROF_TURRETS, start);
+	// attack animations count as drawing
+	prof_skip(PROF_TURRETS, prof_total(PROF_DRAW) - drawn);
+	if (killed >= 0) {
+		g->cash += killed;
+		g->score += killed;
+	}
+
+	g->ticks++;
+}
+
+
+bool game_over(struct game * g) {
+	return g->lives < 0;
+}
+
+
+bool game_buy(struct game * g, int id, int x, int y) {
+	if (id < 0 || id >= ARRLEN(turrets)) return false;
+	if (g->cash < turrets[id].cost) return false;
+	if (g->spawned_turrets.idx >= MAX_TURRETS) return false;
+	if (!can_place(GRID(g), id, x, y)) return false;
+	if (open_map && turrets[id].stack < 0 && !flow_block(g, x * height + y, true))
+		return false;
+
+	turrets_push(&g->spawned_turrets, GRID(g), x, y, id);
+	g->cash -= turrets[id].cost;
+	return true;
+}
+
+
+bool game_upgrade(struct game * g, int i) {
+	if (i < 0 || i >= g->spawned_turrets.idx) return false;
+	struct spawned_turret * st = &g->spawned_turrets.spawned[i];
+	int tid = st->id;
+	int up_idx = st->level;
+	if (up_idx >= turrets[tid].n_upgrades) return false;
+	if (g->cash < turrets[tid].upgrades[up_idx].cost) return false;
+
+	g->cash -= turrets[tid].upgrades[up_idx].cost;
+	sched_remove(&g->spawned_turrets.sched, g->spawned_turrets.order, i,
+	             st->ticks, false);
+	sched_insert(&g->spawned_turrets.sched, g->spawned_turrets.order, i,
+	             turrets[tid].upgrades[up_idx].ticks);
+	g->spawned_turrets.changes++;
+	st->level++;
+	st->radius = turrets[tid].upgrades[up_idx].radius;
+	st->rsplash = turrets[tid].upgrades[up_idx].rsplash;
+	st->damage = turrets[tid].upgrades[up_idx].damage;
+	st->dsplash = turrets[tid].upgrades[up_idx].dsplash;
+	st->ticks = turrets[tid].upgrades[up_idx].ticks;
+	return true;
+}
+
+
+bool game_sell(struct game * g, int i) {
+	if (i < 0 || i >= g->spawned_turrets.idx) return false;
+	struct spawned_turret * st = &g->spawned_turrets.spawned[i];
+	g->cash += sell_value(st);
+	int x = st->x;
+	int y = st->y;
+	bool blocking = turrets[st->id].stack < 0;
+	turrets_pop(&g->spawned_turrets, GRID(g), x, y, i);
+	if (open_map && blocking) flow_unblock(g, x * height + y);
+	return true;
+}
+
+
+/* snapshots */
+
+#define SAVE_MAGIC "TDS"
+#define SAVE_VERSION 9
+
+// the whole game as one flat blob, so it can be written with a single write()
+struct save {
+	char magic[4];
+	uint32_t version;
+	uint64_t size;
+	uint32_t width;
+	uint32_t height;
+	uint32_t open_map;
+	uint64_t ticks;
+	char game[]; // game_size() bytes
+};
+
+
+size_t save_size(void) {
+	return sizeof(struct save) + game_size();
+}
+
+
+struct save * save_new(void) {
+	return malloc(save_size());
+}
+
+
+void game_save(struct save * save, struct game * g) {
+	memcpy(save->magic, SAVE_MAGIC, sizeof(save->magic));
+	save->version = SAVE_VERSION;
+	save->size = save_size();
+	save->width = width;
+	save->height = height;
+	save->open_map = open_map;
+	save->ticks = g->ticks;
+	memcpy(save->game, g, game_size());
+}
+
+
+// fails if the snapshot came from a different version or configuration
+bool game_restore(struct save * save, struct game * g) {
+	if (memcmp(save->magic, SAVE_MAGIC, sizeof(save->magic))) return false;
+	if (save->version != SAVE_VERSION || save->size != save_size()) return false;
+	if (save->width != width || save->height != height) return false;
+	if (save->open_map != open_map) return false;
+	memcpy(g, save->game, game_size());
+	return true;
+}
+
+
+bool save_write(char * path, struct save * save) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return false;
+	size_t size = save_size();
+	ssize_t n = write(fd, save, size);
+	bool ok = n >= 0 && (size_t)n == size;
+	return close(fd) == 0 && ok;
+}
+
+
+bool save_read(char * path, struct save * save) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+	size_t size = save_size();
+	ssize_t n = read(fd, save, size);
+	bool ok = n >= 0 && (size_t)n == size;
+	close(fd);
+	return ok;
+}
+
+
+/* headless batch simulation */
+
+enum plan_op {
+	PLAN_BUY,
+	PLAN_UPGRADE,
+	PLAN_SELL,
+};
+
+
+struct plan {
+	struct plan_step {
+		enum plan_op op;
+		int id;   // turret to buy
+		int x;    // requested position, -1 to pick automatically
+		int y;
+		int step; // earlier buy step to upgrade or sell
+	} * steps;
+
+	int n;
+};
+
+
+int path_coverage(char grid[width][height], int x, int y, int r) {
+	int n = 0;
+	for (int rx = -r; rx <= r; rx++) {
+		for (int ry = -r; ry <= r; ry++) {
+			if (rx*rx + ry*ry > r*r) continue;
+			int dx = rx + x;
+			int dy = ry + y;
+			if (dx < 0 || dx >= width || dy < 0 || dy >= height) continue;
+			if (grid[dx][dy] & CELL_PATH) n++;
+		}
+	}
+	return n;
+}
+
+
+// find a valid cell for a turret, either the one nearest to (x, y) or, if x is
+// negative, the one covering the most path cells
+bool plan_place(struct game * g, int id, int x, int y, int * px, int * py) {
+	char (* grid)[height] = GRID(g);
+	bool found = false;
+	long best = 0;
+
+	if (x < 0) {
+		for (int cx = 0; cx < width; cx++) {
+			for (int cy = 0; cy < height; cy++) {
+				if (!can_place(grid, id, cx, cy)) continue;
+				int score = path_coverage(grid, cx, cy, turrets[id].radius);
+				if (found && score <= best) continue;
+				if (!flow_allows(g, id, cx, cy)) continue;
+				found = true;
+				best = score;
+				*px = cx;
+				*py = cy;
+			}
+		}
+		return found;
+	}
+
+	// search rings around (x, y) until no closer cell can be left
+	int max_r = width > height ? width : height;
+	for (int r = 0; r <= max_r && (!found || (long)r*r <= best); r++) {
+		for (int cx = x - r; cx <= x + r; cx++) {
+			// only the edges of the ring
+			int step = cx == x - r || cx == x + r ? 1 : 2 * r;
+			for (int cy = y - r; cy <= y + r; cy += step ? step : 1) {
+				if (!can_place(grid, id, cx, cy)) continue;
+				long d = (long)(cx - x)*(cx - x) + (long)(cy - y)*(cy - y);
+				// ties go to the lowest x, then y
+				if (found && (d > best || (d == best &&
+				    (cx > *px || (cx == *px && cy > *py))))) continue;
+				if (!flow_allows(g, id, cx, cy)) continue;
+				found = true;
+				best = d;
+				*px = cx;
+				*py = cy;
+			}
+		}
+	}
+	return found;
+}
+
+
+// returns false while the step is waiting on cash, true once it is done with
+// (either applied or impossible on this map)
+bool plan_apply(struct game * g, struct plan * plan, int s, int placed[][2]) {
+	struct plan_step * step = &plan->steps[s];
+	placed[s][0] = -1;
+	placed[s][1] = -1;
+
+	if (step->op == PLAN_BUY) {
+		if (g->cash < turrets[step->id].cost) return false;
+		int x, y;
+		if (!plan_place(g, step->id, step->x, step->y, &x, &y)) return true;
+		if (!game_buy(g, step->id, x, y)) return true;
+		placed[s][0] = x;
+		placed[s][1] = y;
+		return true;
+	}
+
+	int i = find_turret(&g->spawned_turrets, placed[step->step][0],
+	                    placed[step->step][1]);
+	if (i < 0) return true;
+
+	if (step->op == PLAN_SELL) {
+		game_sell(g, i);
+		return true;
+	}
+
+	struct spawned_turret * st = &g->spawned_turrets.spawned[i];
+	if (st->level >= turrets[st->id].n_upgrades) return true;
+	return game_upgrade(g, i);
+}
+
+
+int parse_turret(char * s) {
+	if (strlen(s) == 1) for (int i = 0; i < ARRLEN(turrets); i++) {
+		if (turrets[i].symbol == s[0]) return i;
+	}
+	char * end;
+	long id = strtol(s, &end, 10);
+	if (*end || id < 0 || id >= ARRLEN(turrets)) return -1;
+	return id;
+}
+
+
+/* plan file format, one step per line ('#' starts a comment):
+ *   buy <id|symbol> [x y]  -- without a position, the cell covering the most
+ *                             path is used; an invalid position is moved to
+ *                             the nearest valid cell
+ *   upgrade <step>         -- upgrade the turret bought by step <step>
+ *   sell <step>            -- sell the turret bought by step <step>
+ * steps are numbered from 1 and run in order, each waiting until affordable
+ */
+bool parse_plan(FILE * fp, struct plan * plan) {
+	char line[256];
+	int cap = 0;
+	int lineno = 0;
+	plan->steps = NULL;
+	plan->n = 0;
+
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		char * c = strchr(line, '#');
+		if (c) *c = '\0';
+
+		char op[16], arg[16];
+		int x = -1, y = -1;
+		int n = sscanf(line, "%15s %15s %d %d", op, arg, &x, &y);
+		if (n <= 0) continue;
+
+		struct plan_step step = {0};
+		if (!strcmp(op, "buy") && (n == 2 || n == 4)) {
+			step.op = PLAN_BUY;
+			step.id = parse_turret(arg);
+			step.x = n == 4 ? x : -1;
+			step.y = n == 4 ? y : -1;
+			if (step.id < 0) goto invalid;
+		} else if ((!strcmp(op, "upgrade") || !strcmp(op, "sell")) && n == 2) {
+			step.op = op[0] == 'u' ? PLAN_UPGRADE : PLAN_SELL;
+			step.step = atoi(arg) - 1;
+			if (step.step < 0 || step.step >= plan->n) goto invalid;
+			if (plan->steps[step.step].op != PLAN_BUY) goto invalid;
+		} else goto invalid;
+
+		if (plan->n >= cap) {
+			cap = cap ? cap * 2 : 16;
+			plan->steps = realloc(plan->steps, cap * sizeof(*plan->steps));
+		}
+		plan->steps[plan->n++] = step;
+		continue;
+
+		invalid:
+		fprintf(stderr, "plan: invalid step on line %d\n", lineno);
+		free(plan->steps);
+		return false;
+	}
+
+	return true;
+}
+
+
+// runs a plan from step s until the game ends or, when prefix is set, until
+// the plan's last step has been applied; returns the next step to apply
+int run_plan(
+	struct game * g, struct plan * plan, int s, int placed[][2],
+	unsigned long max_ticks, bool prefix
+) {
+	while (!game_over(g) && g->ticks < max_ticks) {
+		while (s < plan->n && plan_apply(g, plan, s, placed)) s++;
+		if (prefix && s >= plan->n) break;
+		game_tick(g);
+	}
+	return s;
+}
+
+
+struct batch {
+	struct plan * plan;
+	uint64_t seed;
+	unsigned long max_ticks;
+
+	struct result {
+		uint64_t seed;
+		int round;
+		int score;
+		unsigned long ticks;
+		long dropped;
+	} * results;
+};
+
+
+void batch_game(void * ctx, int i) {
+	struct batch * b = ctx;
+	struct game * g = game_new();
+	int (* placed)[2] = malloc((b->plan->n + 1) * sizeof(*placed));
+
+	game_init(g, b->seed + i);
+	run_plan(g, b->plan, 0, placed, b->max_ticks, false);
+
+	b->results[i].seed = b->seed + i;
+	b->results[i].round = g->round;
+	b->results[i].score = g->score;
+	b->results[i].ticks = g->ticks;
+	b->results[i].dropped = g->enemies.dropped;
+
+	free(placed);
+	free(g);
+}
+
+
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+int run_batch(struct plan * plan, uint64_t seed, int games, int threads,
+              unsigned long max_ticks) {
+	struct batch b = {
+		.plan = plan,
+		.seed = seed,
+		.max_ticks = max_ticks,
+		.results = calloc(games, sizeof(*b.results)),
+	};
+
+	pool_start(threads - 1);
+	double start = now();
+	parallel_for(games, batch_game, &b);
+	double elapsed = now() - start;
+
+	unsigned long total_ticks = 0;
+	long total_round = 0;
+	long total_score = 0;
+	long dropped = 0;
+	int min_round = -1, max_round = -1;
+	for (int i = 0; i < games; i++) {
+		struct result * r = &b.results[i];
+		printf("seed %llu: round %d, score %d, %lu ticks\n",
+		       (unsigned long long)r->seed, r->round, r->score, r->ticks);
+		total_ticks += r->ticks;
+		total_round += r->round;
+		total_score += r->score;
+		dropped += r->dropped;
+		if (min_round < 0 || r->round < min_round) min_round = r->round;
+		if (r->round > max_round) max_round = r->round;
+	}
+
+	printf("games: %d, threads: %d\n", games, threads);
+	printf("round: min %d, avg %.2f, max %d\n", min_round,
+	       (double)total_round / games, max_round);
+	printf("score: avg %.2f\n", (double)total_score / games);
+	if (dropped) printf("spawns turned away: %ld\n", dropped);
+	printf("ticks/s: %.0f (%.3fs)\n", total_ticks / elapsed, elapsed);
+
+	free(b.results);
+	return 0;
+}
+
+
+/* stress benchmarks */
+
+// fixed games for catching slowdowns in the simulation. each starts at its
+// round and plays on with unlimited cash and lives, after buying its turrets
+// on the cells covering the most path (fully upgraded if asked), so the waves
+// grow up to MAX_WAVE. spikes are bought again as they run out, and crowded
+// scenarios keep the map full of enemy groups by seeding them along the path
+struct scenario {
+	char * name;
+	int round;
+	bool upgraded;
+	bool crowd;
+	int buy[ARRLEN(turrets)]; // how many of each turret
+} scenarios[] = {
+/*   Name           Round  Upgr   Crowd     M    %    |    &    $ */
+	{"early",          5, false, false, {  0,   2,   1,   0,   0}},
+	{"mid",           30, false, false, {  4,   6,   2,   2,   1}},
+	{"late",          80, false, false, {  0,   8,   4,   4,   4}},
+	{"max-turrets",   30, true,  false, {  0, MAX_TURRETS, 0, 0, 0}},
+	{"splash",        70, false, false, {  0,   0,   0,  24,   0}},
+	{"spikes",        30, false, false, { 64,   0,   0,   0,   0}},
+	{"crowd",         80, false, true,  {  0,   8,   4,   4,   4}},
+};
+
+#define BENCH_SEED 1
+
+
+void scenario_plan(struct scenario * sc, struct plan * plan) {
+	int n = 0;
+	for (int id = 0; id < ARRLEN(turrets); id++) {
+		n += sc->buy[id] * (1 + (sc->upgraded ? turrets[id].n_upgrades : 0));
+	}
+	plan->steps = calloc(n, sizeof(*plan->steps));
+	plan->n = 0;
+
+	for (int id = 0; id < ARRLEN(turrets); id++) {
+		for (int k = 0; k < sc->buy[id]; k++) {
+			int s = plan->n;
+			plan->steps[plan->n++] = (struct plan_step){
+				.op = PLAN_BUY, .id = id, .x = -1, .y = -1,
+			};
+			if (!sc->upgraded) continue;
+			for (int u = 0; u < turrets[id].n_upgrades; u++) {
+				plan->steps[plan->n++] = (struct plan_step){
+					.op = PLAN_UPGRADE, .step = s,
+				};
+			}
+		}
+	}
+}
+
+
+// runs one scenario and prints its result as a line of JSON. only the ticks
+// are timed, and spare threads find the turrets' targets
+void run_scenario(struct scenario * sc, int threads, unsigned long max_ticks) {
+	pool_start(threads - 1);
+	parallel_targets = threads > 1;
+
+	struct plan plan;
+	scenario_plan(sc, &plan);
+	int (* placed)[2] = malloc((plan.n + 1) * sizeof(*placed));
+
+	struct game * g = game_new();
+	game_init(g, BENCH_SEED);
+	g->round = sc->round;
+	g->cash = INT_MAX / 2;
+	g->lives = INT_MAX / 2;
+	run_plan(g, &plan, 0, placed, ULONG_MAX, true);
+	int bought = g->spawned_turrets.idx;
+
+	int n_path = 0;
+	int * path = malloc((size_t)width * height * sizeof(*path));
+	for (int i = 0; i < width * height; i++) {
+		if (g->cells[i] & CELL_PATH) path[n_path++] = i;
+	}
+	uint64_t rng = BENCH_SEED;
+
+	// an update is one enemy group moving or one turret attacking, or at
+	// least being looked at for it
+	long updates = 0;
+	long score = 0;
+	int peak = 0;
+	unsigned long ticks = 0;
+	double elapsed = 0;
+	for (; ticks < max_ticks && !game_over(g); ticks++) {
+		// the crowd doesn't count towards the wave, which spawns as usual
+		int spawned = g->enemies.spawned;
+		while (sc->crowd && n_path && g->enemies.idx < MAX_ENEMIES) {
+			int i = path[rng_next(&rng) % n_path];
+			enemies_push(&g->enemies, i / height, i % height,
+			             get_stack(&rng, g->round), get_speed(&rng, g->round), 1);
+		}
+		g->enemies.spawned = spawned;
+
+		updates += g->enemies.idx + g->spawned_turrets.idx;
+		if (g->enemies.idx > peak) peak = g->enemies.idx;
+		double start = now();
+		game_tick(g);
+		elapsed += now() - start;
+		// late waves would overflow these
+		score += g->score;
+		g->score = 0;
+		g->cash = INT_MAX / 2;
+		g->lives = INT_MAX / 2;
+		// put back spikes that ran out
+		if (g->spawned_turrets.idx < bought) for (int s = 0; s < plan.n; s++) {
+			int x = placed[s][0], y = placed[s][1];
+			if (plan.steps[s].op != PLAN_BUY || x < 0) continue;
+			if (find_turret(&g->spawned_turrets, x, y) < 0) {
+				game_buy(g, plan.steps[s].id, x, y);
+			}
+		}
+	}
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	printf("{\"scenario\": \"%s\", \"ticks\": %lu, \"seconds\": %.6f, "
+	       "\"ticks_per_s\": %.0f, \"ns_per_update\": %.2f, "
+	       "\"peak_rss_kb\": %ld, \"peak_enemies\": %d, \"turrets\": %d, "
+	       "\"round\": %d, \"score\": %ld, \"turned_away\": %ld}\n",
+	       sc->name, ticks, elapsed, ticks / elapsed,
+	       updates ? elapsed * 1e9 / updates : 0.0, ru.ru_maxrss, peak,
+	       g->spawned_turrets.idx, g->round, score, g->enemies.dropped);
+
+	free(g);
+	free(path);
+	free(placed);
+	free(plan.steps);
+}
+
+
+// runs the scenarios whose names are given (all of them if none are), each in
+// its own process so that its peak memory is its own
+int run_bench(char ** names, int n, int threads, unsigned long max_ticks) {
+	int ran = 0;
+	for (int i = 0; i < ARRLEN(scenarios); i++) {
+		bool wanted = n == 0;
+		for (int k = 0; k < n; k++) {
+			if (!strcmp(names[k], scenarios[i].name)) wanted = true;
+		}
+		if (!wanted) continue;
+		ran++;
+
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (pid == 0) {
+			run_scenario(&scenarios[i], threads, max_ticks);
+			exit(0);
+		}
+		int status;
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) return 1;
+	}
+
+	if (ran < n) {
+		fprintf(stderr, "unknown scenario, expected one of:");
+		for (int i = 0; i < ARRLEN(scenarios); i++) {
+			fprintf(stderr, " %s", scenarios[i].name);
+		}
+		fprintf(stderr, "\n");
+		return 1;
+	}
+	return 0;
+}
+
+
+/* Monte Carlo turret placement optimizer */
+
+#define OPT_MAX_STEPS 64 // longest plan the optimizer builds
+#define OPT_CELLS 8      // candidate cells per turret
+
+
+// a game partway through a plan
+struct rollout {
+	struct game * g;
+	int placed[OPT_MAX_STEPS][2];
+	int next;
+};
+
+
+struct optimizer {
+	struct game * map;
+	struct plan plan;
+	uint64_t wave_seed;
+	int waves;
+	unsigned long max_ticks;
+
+	struct plan_step * candidates;
+	int n_candidates;
+
+	struct rollout * forks; // per wave, state right after the plan's last step
+	struct result * base;   // per wave, result of the plan by itself
+	struct result * results; // per candidate and wave
+};
+
+
+void rollout_result(struct rollout * r, struct result * res) {
+	res->round = r->g->round;
+	res->score = r->g->score;
+	res->ticks = r->g->ticks;
+}
+
+
+void opt_prefix(void * ctx, int w) {
+	struct optimizer * o = ctx;
+	struct rollout * f = &o->forks[w];
+	game_copy(f->g, o->map);
+	f->g->rng = o->wave_seed + w;
+	f->next = run_plan(f->g, &o->plan, 0, f->placed, o->max_ticks, true);
+
+	struct rollout r = *f;
+	r.g = game_new();
+	game_copy(r.g, f->g);
+	run_plan(r.g, &o->plan, r.next, r.placed, o->max_ticks, false);
+	rollout_result(&r, &o->base[w]);
+	free(r.g);
+}
+
+
+void opt_rollout(void * ctx, int i) {
+	struct optimizer * o = ctx;
+	int c = i / o->waves;
+	int w = i % o->waves;
+
+	struct plan_step steps[OPT_MAX_STEPS];
+	memcpy(steps, o->plan.steps, o->plan.n * sizeof(*steps));
+	steps[o->plan.n] = o->candidates[c];
+	struct plan plan = {steps, o->plan.n + 1};
+
+	struct rollout r = o->forks[w];
+	r.g = game_new();
+	game_copy(r.g, o->forks[w].g);
+	run_plan(r.g, &plan, r.next, r.placed, o->max_ticks, false);
+	rollout_result(&r, &o->results[i]);
+	free(r.g);
+}
+
+
+// mean round reached, with the mean score breaking ties
+double plan_value(struct result * results, int n) {
+	double round = 0, score = 0;
+	for (int i = 0; i < n; i++) {
+		round += results[i].round;
+		score += results[i].score;
+	}
+	return (round + score / 1e6) / n;
+}
+
+
+// cost of a plan step given the steps before it
+int step_cost(struct plan * plan, int s) {
+	struct plan_step * step = &plan->steps[s];
+	if (step->op == PLAN_SELL) return 0;
+	if (step->op == PLAN_BUY) return turrets[step->id].cost;
+
+	int level = 0;
+	for (int i = 0; i < s; i++) {
+		if (plan->steps[i].op == PLAN_UPGRADE && plan->steps[i].step == step->step)
+			level++;
+	}
+	int id = plan->steps[step->step].id;
+	if (level >= turrets[id].n_upgrades) return 0;
+	return turrets[id].upgrades[level].cost;
+}
+
+
+// the cells covering the most path for every turret
+void opt_cells(struct game * g, int cells[][OPT_CELLS][2]) {
+	char (* grid)[height] = GRID(g);
+	for (int id = 0; id < ARRLEN(turrets); id++) {
+		int cover[OPT_CELLS];
+		for (int k = 0; k < OPT_CELLS; k++) {
+			cover[k] = -1;
+			cells[id][k][0] = -1;
+		}
+
+		// spikes only sit on a single path cell, so favour bends
+		int r = turrets[id].radius > 0 ? turrets[id].radius : 1;
+		for (int x = 0; x < width; x++) for (int y = 0; y < height; y++) {
+			if (!can_place(grid, id, x, y)) continue;
+			int n = path_coverage(grid, x, y, r);
+			if (n <= cover[OPT_CELLS - 1]) continue;
+			if (!flow_allows(g, id, x, y)) continue;
+
+			int k = OPT_CELLS - 1;
+			for (; k > 0 && cover[k - 1] < n; k--) {
+				cover[k] = cover[k - 1];
+				cells[id][k][0] = cells[id][k - 1][0];
+				cells[id][k][1] = cells[id][k - 1][1];
+			}
+			cover[k] = n;
+			cells[id][k][0] = x;
+			cells[id][k][1] = y;
+		}
+	}
+}
+
+
+// next steps worth trying: buys on the best cells not yet taken and upgrades
+// of turrets already bought, pruned to what the plan could ever pay for
+int opt_candidates(struct optimizer * o, int cells[][OPT_CELLS][2], int budget) {
+	struct plan * plan = &o->plan;
+	int cost = 0;
+	for (int s = 0; s < plan->n; s++) cost += step_cost(plan, s);
+
+	int n = 0;
+	for (int id = 0; id < ARRLEN(turrets); id++) {
+		if (cost + turrets[id].cost > budget) continue;
+		for (int k = 0; k < OPT_CELLS; k++) {
+			int x = cells[id][k][0];
+			int y = cells[id][k][1];
+			if (x < 0) break;
+
+			bool taken = false;
+			for (int s = 0; s < plan->n; s++) {
+				struct plan_step * step = &plan->steps[s];
+				if (step->op == PLAN_BUY && step->x == x && step->y == y)
+					taken = true;
+			}
+			if (taken) continue;
+
+			o->candidates[n++] = (struct plan_step){
+				.op = PLAN_BUY, .id = id, .x = x, .y = y,
+			};
+		}
+	}
+
+	for (int s = 0; s < plan->n; s++) {
+		if (plan->steps[s].op != PLAN_BUY) continue;
+		plan->steps[plan->n] = (struct plan_step){
+			.op = PLAN_UPGRADE, .step = s,
+		};
+		plan->n++;
+		int up = step_cost(plan, plan->n - 1);
+		plan->n--;
+		if (up == 0 || cost + up > budget) continue;
+		o->candidates[n++] = plan->steps[plan->n];
+	}
+
+	return n;
+}
+
+
+void print_plan(FILE * fp, struct plan * plan) {
+	for (int s = 0; s < plan->n; s++) {
+		struct plan_step * step = &plan->steps[s];
+		struct plan_step * buy = step->op == PLAN_BUY ?
+		                         step : &plan->steps[step->step];
+		switch (step->op) {
+			case PLAN_BUY:
+				fprintf(fp, "buy %d %d %d", step->id, step->x, step->y);
+				break;
+			case PLAN_UPGRADE:
+				fprintf(fp, "upgrade %d", step->step + 1);
+				break;
+			case PLAN_SELL:
+				fprintf(fp, "sell %d", step->step + 1);
+				break;
+		}
+		fprintf(fp, "\t# %d: %s\n", s + 1, turrets[buy->id].name);
+	}
+}
+
+
+int run_optimizer(uint64_t seed, int waves, int threads, unsigned long max_ticks) {
+	pool_start(threads - 1);
+
+	struct optimizer * o = calloc(1, sizeof(*o));
+	o->map = game_new();
+	game_init(o->map, seed);
+	o->wave_seed = seed;
+	o->waves = waves;
+	o->max_ticks = max_ticks;
+	o->plan.steps = calloc(OPT_MAX_STEPS, sizeof(*o->plan.steps));
+
+	int cells[ARRLEN(turrets)][OPT_CELLS][2];
+	opt_cells(o->map, cells);
+	int max_candidates = ARRLEN(turrets) * OPT_CELLS + OPT_MAX_STEPS;
+	o->candidates = malloc(max_candidates * sizeof(*o->candidates));
+	o->forks = malloc(waves * sizeof(*o->forks));
+	for (int w = 0; w < waves; w++) o->forks[w].g = game_new();
+	o->base = malloc(waves * sizeof(*o->base));
+	o->results = malloc(max_candidates * waves * sizeof(*o->results));
+
+	long rollouts = 0;
+	double start = now();
+	double value;
+	while (true) {
+		parallel_for(waves, opt_prefix, o);
+		rollouts += waves;
+		value = plan_value(o->base, waves);
+		if (o->plan.n >= OPT_MAX_STEPS - 1) break;
+
+		// the plan can't spend more than it ever earns
+		int budget = 0;
+		for (int w = 0; w < waves; w++) {
+			if (o->base[w].score > budget) budget = o->base[w].score;
+		}
+		budget += STARTING_CASH;
+
+		o->n_candidates = opt_candidates(o, cells, budget);
+		if (o->n_candidates == 0) break;
+		parallel_for(o->n_candidates * waves, opt_rollout, o);
+		rollouts += o->n_candidates * waves;
+
+		int best = -1;
+		double best_value = value;
+		for (int c = 0; c < o->n_candidates; c++) {
+			double v = plan_value(&o->results[c * waves], waves);
+			if (v <= best_value) continue;
+			best = c;
+			best_value = v;
+		}
+		if (best < 0) break;
+
+		o->plan.steps[o->plan.n++] = o->candidates[best];
+		fprintf(stderr, "step %d: round %.2f, %d candidates, %.0f rollouts/s\n",
+		        o->plan.n, best_value, o->n_candidates,
+		        rollouts / (now() - start));
+	}
+	double elapsed = now() - start;
+
+	printf("# seed %llu, expected round %.2f over %d waves\n",
+	       (unsigned long long)seed, value, waves);
+	printf("# %ld rollouts in %.3fs (%.0f/min)\n",
+	       rollouts, elapsed, rollouts / elapsed * 60);
+	print_plan(stdout, &o->plan);
+
+	free(o->results);
+	free(o->base);
+	for (int w = 0; w < waves; w++) free(o->forks[w].g);
+	free(o->forks);
+	free(o->map);
+	free(o->candidates);
+	free(o->plan.steps);
+	free(o);
+	return 0;
+}
+
+
+/* input recording and replay */
+
+#define RECORD_MAGIC "TDR"
+#define RECORD_VERSION 7
+
+enum record_op {
+	REC_END,
+	REC_BUY,
+	REC_UPGRADE,
+	REC_SELL,
+	REC_PAUSE, // toggles pause
+	REC_CHECKSUM,
+	REC_RESTORE, // continues from a snapshot
+};
+
+
+struct record_event {
+	unsigned long tick;
+	enum record_op op;
+	int id;
+	int x;
+	int y;
+	uint32_t checksum;
+	struct save * save;
+};
+
+
+struct recorder {
+	FILE * fp;
+	unsigned long last_tick;
+};
+
+
+uint32_t fnv1a(uint32_t h, void * p, size_t n) {
+	unsigned char * c = p;
+	for (size_t i = 0; i < n; i++) {
+		h ^= c[i];
+		h *= 16777619;
+	}
+	return h;
+}
+
+
+uint32_t game_checksum(struct game * g) {
+	uint32_t h = 2166136261u;
+	long state[] = {
+		g->enemies.idx, g->enemies.last_round, g->enemies.spawned,
+		g->enemies.killed, g->enemies.to_spawn, g->spawned_turrets.idx,
+		g->cash, g->lives, g->round, g->score, g->ticks,
+	};
+	h = fnv1a(h, state, sizeof(state));
+	h = fnv1a(h, &g->rng, sizeof(g->rng));
+	h = fnv1a(h, g->cells, (size_t)width * height);
+	h = fnv1a(h, g->enemies.enemies,
+	          g->enemies.idx * sizeof(*g->enemies.enemies));
+	h = fnv1a(h, g->spawned_turrets.spawned,
+	          g->spawned_turrets.idx * sizeof(*g->spawned_turrets.spawned));
+	return h;
+}
+
+
+void put_varint(FILE * fp, uint64_t v) {
+	while (v >= 0x80) {
+		fputc((v & 0x7F) | 0x80, fp);
+		v >>= 7;
+	}
+	fputc(v, fp);
+}
+
+
+bool get_varint(FILE * fp, uint64_t * v) {
+	*v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		int c = fgetc(fp);
+		if (c == EOF) return false;
+		*v |= (uint64_t)(c & 0x7F) << shift;
+		if (!(c & 0x80)) return true;
+	}
+	return false;
+}
+
+
+void record_start(struct recorder * r, uint64_t seed) {
+	fwrite(RECORD_MAGIC, 1, strlen(RECORD_MAGIC), r->fp);
+	fputc(RECORD_VERSION, r->fp);
+	put_varint(r->fp, seed);
+	put_varint(r->fp, width);
+	put_varint(r->fp, height);
+	put_varint(r->fp, open_map);
+	r->last_tick = 0;
+}
+
+
+// events are a tick delta, an op, and the op's arguments
+void record_event(struct recorder * r, struct record_event e) {
+	if (!r->fp) return;
+	put_varint(r->fp, e.tick - r->last_tick);
+	fputc(e.op, r->fp);
+	switch (e.op) {
+		case REC_BUY:
+			put_varint(r->fp, e.id);
+			// fallthrough
+		case REC_UPGRADE:
+		case REC_SELL:
+			put_varint(r->fp, e.x);
+			put_varint(r->fp, e.y);
+			break;
+		case REC_CHECKSUM:
+			put_varint(r->fp, e.checksum);
+			break;
+		case REC_RESTORE:
+			fwrite(e.save, save_size(), 1, r->fp);
+			break;
+		default: break;
+	}
+	// ticks restart from the snapshot's
+	r->last_tick = e.op == REC_RESTORE ? e.save->ticks : e.tick;
+}
+
+
+bool read_header(FILE * fp, uint64_t * seed) {
+	char magic[sizeof(RECORD_MAGIC)] = {0};
+	if (fread(magic, 1, strlen(RECORD_MAGIC), fp) != strlen(RECORD_MAGIC))
+		return false;
+	if (strcmp(magic, RECORD_MAGIC)) return false;
+	if (fgetc(fp) != RECORD_VERSION) return false;
+
+	// the map is part of the game, so it replaces whatever was given
+	uint64_t w, h, open;
+	if (!get_varint(fp, seed) || !get_varint(fp, &w) || !get_varint(fp, &h) ||
+	    !get_varint(fp, &open))
+		return false;
+	if (w < 1 || w > MAX_DIM || h < 1 || h > MAX_DIM || open > 1) return false;
+	width = w;
+	height = h;
+	open_map = open;
+	return true;
+}
+
+
+bool read_event(FILE * fp, unsigned long * last_tick, struct record_event * e) {
+	uint64_t v, id = 0, x = 0, y = 0, sum = 0;
+	if (!get_varint(fp, &v)) return false;
+	e->tick = *last_tick + v;
+	int op = fgetc(fp);
+	switch (op) {
+		case REC_BUY:
+			if (!get_varint(fp, &id)) return false;
+			// fallthrough
+		case REC_UPGRADE:
+		case REC_SELL:
+			if (!get_varint(fp, &x) || !get_varint(fp, &y)) return false;
+			break;
+		case REC_CHECKSUM:
+			if (!get_varint(fp, &sum)) return false;
+			break;
+		case REC_RESTORE:
+			if (fread(e->save, save_size(), 1, fp) != 1) return false;
+			break;
+		case REC_END:
+		case REC_PAUSE:
+			break;
+		default: return false;
+	}
+	e->op = op;
+	e->id = id;
+	e->x = x;
+	e->y = y;
+	e->checksum = sum;
+	*last_tick = op == REC_RESTORE ? e->save->ticks : e->tick;
+	return true;
+}
+
+
+enum replay_result {
+	REPLAY_OK,
+	REPLAY_MISMATCH,
+	REPLAY_CORRUPT,
+	REPLAY_ABORTED,
+};
+
+
+// replays a single recorded game, drawing each tick if delay is nonnegative
+enum replay_result replay_game(
+	FILE * fp, struct game * g, uint64_t seed, int delay, int * checksums
+) {
+	game_init(g, seed);
+	// each game in a recording can have its own map size
+	if (delay >= 0) view_resize();
+	bool paused = true;
+	unsigned long last_tick = 0;
+	struct save * save = save_new();
+	struct record_event e = {.save = save};
+	enum replay_result res = REPLAY_CORRUPT;
+	if (!read_event(fp, &last_tick, &e)) goto done;
+
+	while (true) {
+		prof_frame(g);
+		if (!paused) game_tick(g);
+		else g->ticks++;
+
+		if (e.tick < g->ticks) goto done;
+		while (e.tick == g->ticks) {
+			int i = find_turret(&g->spawned_turrets, e.x, e.y);
+			switch (e.op) {
+				case REC_END:
+					res = REPLAY_OK;
+					goto done;
+				case REC_BUY: game_buy(g, e.id, e.x, e.y); break;
+				case REC_UPGRADE: game_upgrade(g, i); break;
+				case REC_SELL: game_sell(g, i); break;
+				case REC_PAUSE: paused = !paused; break;
+				case REC_CHECKSUM:
+					if (game_checksum(g) != e.checksum) {
+						res = REPLAY_MISMATCH;
+						goto done;
+					}
+					(*checksums)++;
+					break;
+				case REC_RESTORE:
+					if (!game_restore(save, g)) goto done;
+					break;
+			}
+			if (!read_event(fp, &last_tick, &e)) goto done;
+		}
+
+		if (delay >= 0) {
+			uint64_t start = prof_begin();
+			draw_game(g);
+			if (prof.overlay) draw_profile();
+			move(view.h + 2, view.w + 2 - 9);
+			addstr("q to quit");
+			move(view.h + 3, view.w + 2 - 14);
+			printw("Tick %7lu", g->ticks);
+			refresh();
+			prof_end(PROF_DRAW, start);
+			int c = getch();
+			if (c == 'p' || c == 't') view_invalidate();
+			if (!view_key(c)) prof_key(c);
+			if (c == 'q') {
+				res = REPLAY_ABORTED;
+				goto done;
+			}
+		}
+	}
+
+	done:
+	free(save);
+	return res;
+}
+
+
+int run_replay(char * path, int delay) {
+	FILE * fp = fopen(path, "rb");
+	if (!fp) {
+		perror(path);
+		return 1;
+	}
+
+	if (delay >= 0) {
+		prof.on = true;
+		initscr();
+		noecho();
+		curs_set(0);
+		keypad(stdscr, TRUE);
+		timeout(delay);
+		use_default_colors();
+		start_color();
+		init_pair(RED, COLOR_RED, -1);
+		init_pair(GREEN, COLOR_GREEN, -1);
+		init_pair(YELLOW, COLOR_YELLOW, -1);
+		init_pair(BLUE, COLOR_BLUE, -1);
+		init_pair(MAGENTA, COLOR_MAGENTA, -1);
+		init_pair(CYAN, COLOR_CYAN, -1);
+	}
+
+	struct game * g = NULL;
+	char * results[] = {
+		[REPLAY_OK] = "ok",
+		[REPLAY_MISMATCH] = "checksum mismatch",
+		[REPLAY_CORRUPT] = "corrupt recording",
+		[REPLAY_ABORTED] = "aborted",
+	};
+	int ret = 0;
+	uint64_t seed;
+	for (int n = 1; read_header(fp, &seed); n++) {
+		int checksums = 0;
+		free(g);
+		g = game_new();
+		double start = now();
+		enum replay_result res = replay_game(fp, g, seed, delay, &checksums);
+		double elapsed = now() - start;
+
+		if (delay >= 0) endwin();
+		printf("game %d: seed %llu, round %d, score %d, %lu ticks, "
+		       "%d checksums, %s\n", n, (unsigned long long)seed, g->round,
+		       g->score, g->ticks, checksums, results[res]);
+		if (delay < 0) printf("ticks/s: %.0f (%.3fs)\n",
+		                      g->ticks / elapsed, elapsed);
+		if (res != REPLAY_OK) {
+			if (res != REPLAY_ABORTED) ret = 1;
+			break;
+		}
+	}
+
+	if (delay >= 0 && !isendwin()) endwin();
+	free(g);
+	fclose(fp);
+	return ret;
+}
+
+
+void record_end(struct recorder * rec, struct game * g) {
+	record_event(rec, (struct record_event){
+		.tick = g->ticks, .op = REC_CHECKSUM, .checksum = game_checksum(g),
+	});
+	record_event(rec, (struct record_event){
+		.tick = g->ticks, .op = REC_END,
+	});
+	if (rec->fp) fflush(rec->fp);
+}
+
+
+bool load_checkpoint(struct game * g, struct save * save, struct recorder * rec) {
+	unsigned long ticks = g->ticks;
+	if (!save_read(SAVE_FILE, save) || !game_restore(save, g)) {
+		move(view.h/2 + 1, view.w/2 + 1 - 7);
+		attron(A_REVERSE);
+		addstr("No saved game");
+		attroff(A_REVERSE);
+		refresh();
+		napms(500);
+		return false;
+	}
+
+	record_event(rec, (struct record_event){
+		.tick = ticks, .op = REC_RESTORE, .save = save,
+	});
+	heat_invalidate();
+	return true;
+}
+
+
+void usage(char * argv0) {
+	fprintf(stderr,
+	        "usage: %s [-f] [-x width] [-y height] [-s seed] [-r recording]\n"
+	        "       %s -b plan [-f] [-x width] [-y height] [-s seed] [-n games]\n"
+	        "          [-j threads] [-t ticks]\n"
+	        "       %s -o [-f] [-x width] [-y height] [-s seed] [-n waves]\n"
+	        "          [-j threads] [-t ticks]\n"
+	        "       %s -p recording [-v] [-d delay]\n"
+	        "       %s -B [-f] [-x width] [-y height] [-j threads] [-t ticks]\n"
+	        "          [scenario...]\n",
+	        argv0, argv0, argv0, argv0, argv0);
+}
+
+
+int main(int argc, char ** argv) {
+	uint64_t seed = SEED;
+	char * plan_path = NULL;
+	int games = 0;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long max_ticks = MAX_TICKS;
+	char * record_path = NULL;
+	char * replay_path = NULL;
+	bool visual = false;
+	bool optimize = false;
+	bool bench = false;
+	int delay = DELAY;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "b:s:n:j:t:r:p:vd:ox:y:fB")) != -1) {
+		switch (opt) {
+			case 'f': open_map = true; break;
+			case 'x': width = atoi(optarg); break;
+			case 'y': height = atoi(optarg); break;
+			case 'o': optimize = true; break;
+			case 'B': bench = true; break;
+			case 'b': plan_path = optarg; break;
+			case 'r': record_path = optarg; break;
+			case 'p': replay_path = optarg; break;
+			case 'v': visual = true; break;
+			case 'd': delay = atoi(optarg); break;
+			case 's': seed = strtoull(optarg, NULL, 10); break;
+			case 'n': games = atoi(optarg); break;
+			case 'j': threads = atoi(optarg); break;
+			case 't': max_ticks = strtoul(optarg, NULL, 10); break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (width < 1 || width > MAX_DIM || height < 1 || height > MAX_DIM) {
+		fprintf(stderr, "map size must be between 1 and %d\n", MAX_DIM);
+		return 1;
+	}
+
+	if (plan_path) {
+		FILE * fp = fopen(plan_path, "r");
+		if (!fp) {
+			perror(plan_path);
+			return 1;
+		}
+		struct plan plan;
+		bool ok = parse_plan(fp, &plan);
+		fclose(fp);
+		if (!ok) return 1;
+		if (games < 1) games = 1000;
+		if (threads < 1) threads = 1;
+
+		// threads left over once every game has one go to its targeting
+		parallel_targets = games < threads;
+		headless = true;
+		int ret = run_batch(&plan, seed, games, threads, max_ticks);
+		free(plan.steps);
+		return ret;
+	}
+
+	if (bench) {
+		if (threads < 1) threads = 1;
+		headless = true;
+		return run_bench(argv + optind, argc - optind, threads, max_ticks);
+	}
+
+	if (optimize) {
+		if (games < 1) games = 32;
+		if (threads < 1) threads = 1;
+
+		headless = true;
+		return run_optimizer(seed, games, threads, max_ticks);
+	}
+
+	if (threads < 1) threads = 1;
+	pool_start(threads - 1);
+	parallel_targets = threads > 1;
+
+	if (replay_path) {
+		headless = true;
+		if (delay < 0) delay = 0;
+		return run_replay(replay_path, visual ? delay : -1);
+	}
+
+	struct recorder rec = {0};
+	if (record_path) {
+		rec.fp = fopen(record_path, "wb");
+		if (!rec.fp) {
+			perror(record_path);
+			return 1;
+		}
+	}
+
+	prof.on = true;
 	initscr();
 	noecho();
 	curs_set(0);
 	keypad(stdscr, TRUE);
 	timeout(DELAY);
 
-	mousemask(BUTTON1_CLICKED, NULL);
+	mmask_t mask = BUTTON1_CLICKED | BUTTON4_PRESSED | BUTTON_SHIFT;
+#ifdef BUTTON5_PRESSED
+	mask |= BUTTON5_PRESSED;
+#endif
+	mousemask(mask, NULL);
 
 	use_default_colors();
 	start_color();
@@ -831,139 +3545,181 @@ int main(void) {
 	init_pair(MAGENTA, COLOR_MAGENTA, -1);
 	init_pair(CYAN, COLOR_CYAN, -1);
 
+	view_resize();
+	struct game * g = game_new();
+	struct save * save = save_new();
+	bool paused = true;
+	bool retry = false;
 	while (true) {
-		char grid[X][Y] = {};
-		struct enemies enemies = {};
-		struct turrets spawned_turrets = {};
-
-		int cash = STARTING_CASH;
-		int lives = STARTING_LIVES;
-		int round = STARTING_ROUND;
-		int score = 0;
-
-		generate_path(grid, &enemies);
+		if (!retry) {
+			if (rec.fp) record_start(&rec, seed);
+			game_init(g, seed++);
+		}
+		retry = false;
+		paused = true;
+		view_invalidate();
+		heat_invalidate();
 
-		bool paused = true;
 		int done = RUNNING;
 		while (!done) {
+			prof_frame(g);
 			if (!paused) {
-				int deaths = spawn_enemies(&enemies, grid, round);
-				lives -= deaths;
-
-				if (no_enemies(&enemies)) {
-					round++;
-				}
+				game_tick(g);
 
-				if (lives < 0) {
+				if (game_over(g)) {
 					done = GAME_OVER;
 				}
+			} else g->ticks++;
 
-				int killed = run_turrets(&spawned_turrets, &enemies, grid);
-				if (killed >= 0) {
-					cash += killed;
-					score += killed;
-				}
+			if (g->ticks % CHECKSUM_TICKS == 0) {
+				record_event(&rec, (struct record_event){
+					.tick = g->ticks, .op = REC_CHECKSUM,
+					.checksum = game_checksum(g),
+				});
 			}
 
-			erase();
-			draw_grid(grid);
-			draw_enemies(&enemies);
-			draw_shop(cash);
-			move(Y + 2, 0);
-			printw("Round: %d\n", round);
-			printw("Lives: %d\n", lives);
-			printw("Cash: %d\n", cash);
-			printw("Score: %d\n", score);
-			move(Y + 2, X + 2 - 9);
+			bool was_paused = paused;
+
+			uint64_t start = prof_begin();
+			draw_game(g);
+			if (prof.overlay) draw_profile();
+			move(view.h + 2, view.w + 2 - 9);
 			addstr("q to quit");
-			move(Y + 3, X + 2 - 14);
+			move(view.h + 3, view.w + 2 - 14);
 			if (paused) addstr(" Any to resume");
 			else addstr("Space to pause");
 			refresh();
+			prof_end(PROF_DRAW, start);
 
-			switch (getch()) {
+			int c = getch();
+			// anything but a tick may have drawn over the screen
+			if (c != ERR) view_invalidate();
+			switch (c) {
 				case 'q': done = QUIT; break;
 				case ' ':
 					paused = !paused;
 					break;
+				case 's':;
+					double saving = now();
+					game_save(save, g);
+					bool saved = save_write(SAVE_FILE, save);
+					double elapsed = now() - saving;
+					move(view.h/2 + 1, view.w/2 + 1 - 9);
+					attron(A_REVERSE);
+					if (saved) printw("Saved in %5.0fus", elapsed * 1e6);
+					else addstr("  Save failed   ");
+					attroff(A_REVERSE);
+					refresh();
+					napms(500);
+					break;
+				case 'l':
+					if (load_checkpoint(g, save, &rec)) paused = true;
+					break;
 				case KEY_MOUSE:;
 					MEVENT e;
 					if (getmouse(&e) != OK) break;
 
-					int id = yx_to_shop_id(e.y, e.x);
+					int x, y;
+					int id = -1;
+					if (e.bstate & BUTTON1_CLICKED) id = yx_to_shop_id(e.y, e.x);
 					if (id >= 0) {
-						int cost = try_purchase(grid, id, cash, &spawned_turrets);
-						if (cost < 0) {
-							move(Y/2 + 1, X/2 + 1 - 9);
+						int ret = try_purchase(g, id, &x, &y);
+						if (ret < 0) {
+							move(view.h/2 + 1, view.w/2 + 1 - 9);
 							attron(A_REVERSE);
 							addstr("Insufficient Funds");
 							attroff(A_REVERSE);
 							refresh();
 							napms(500);
-						} else {
-							cash -= cost;
+						} else if (ret > 0 && game_buy(g, id, x, y)) {
+							record_event(&rec, (struct record_event){
+								.tick = g->ticks, .op = REC_BUY,
+								.id = id, .x = x, .y = y,
+							});
 						}
-					} else {
-						int tid = -1;
-						int x, y;
-						for (int i = 0; i < spawned_turrets.idx; i++) {
-							x = spawned_turrets.spawned[i].x;
-							y = spawned_turrets.spawned[i].y;
-							if (x != e.x - 1 || y != e.y - 1) continue;
-							
-							tid = i;
-							break;
-						}
-
+					} else if (view_mouse(&e, &x, &y)) {
+						int tid = find_turret(&g->spawned_turrets, x, y);
 						if (tid >= 0) {
-							int cost = try_upgrade(tid, cash, &spawned_turrets, grid);
-							cash -= cost;
-							// turret was sold, remove it
-							if (cost < 0) {
-								turrets_pop(&spawned_turrets, grid, x, y, tid);
+							enum record_op op = REC_END;
+							switch (try_upgrade(tid, g->cash, &g->spawned_turrets, GRID(g))) {
+								case ACTION_UPGRADE:
+									if (game_upgrade(g, tid)) op = REC_UPGRADE;
+									break;
+								case ACTION_SELL:
+									if (game_sell(g, tid)) op = REC_SELL;
+									break;
+								case ACTION_NONE: break;
+							}
+							if (op != REC_END) {
+								record_event(&rec, (struct record_event){
+									.tick = g->ticks, .op = op, .x = x, .y = y,
+								});
 							}
 						}
 					}
 					break;
 				case ERR: break;
 				default:
+					if (view_key(c) || prof_key(c)) break;
 					if (paused) paused = false;
 					break;
 			}
 
-			ticks++;
+			if (paused != was_paused) {
+				record_event(&rec, (struct record_event){
+					.tick = g->ticks, .op = REC_PAUSE,
+				});
+			}
 		}
 
 		switch (done) {
-			case QUIT: goto terminate;
+			case QUIT:
+				record_end(&rec, g);
+				goto terminate;
 			case GAME_OVER:
-				move(Y/2 + 1, X/2 + 1 - 12);
+				move(view.h/2 + 1, view.w/2 + 1 - 12);
 				addch(' ');
 				attron(A_REVERSE);
 				addstr("You ran out of lives :(");
 				attroff(A_REVERSE);
 				addch(' ');
-				move(Y/2 + 2, X/2 + 1 - 12);
+				move(view.h/2 + 2, view.w/2 + 1 - 12);
 				addch(' ');
 				attron(A_REVERSE);
-				printw("Final Score: %9d ", score);
+				printw("Final Score: %9d ", g->score);
 				attroff(A_REVERSE);
 				addch(' ');
 				break;
 		}
 
-		move(Y/2 + 3, X/2 + 1 - 14);
+		move(view.h/2 + 3, view.w/2 + 1 - 20);
 		addch(' ');
 		attron(A_REVERSE);
-		addstr("Any to play again, q to quit");
+		addstr("Any to play again, l to load, q to quit");
 		attroff(A_REVERSE);
 		addch(' ');
 		timeout(-1);
-		if (getch() == 'q') goto terminate;
+		int c = getch();
 		timeout(DELAY);
+		if (c == 'l' && load_checkpoint(g, save, &rec)) {
+			// the recording continues the same game from the snapshot
+			if (!paused) {
+				record_event(&rec, (struct record_event){
+					.tick = g->ticks, .op = REC_PAUSE,
+				});
+			}
+			retry = true;
+			continue;
+		}
+
+		record_end(&rec, g);
+		if (c == 'q') goto terminate;
 	}
 
 	terminate:
+	free(save);
+	free(g);
+	if (rec.fp) fclose(rec.fp);
 	keypad(stdscr, FALSE);
 	curs_set(1);
 	echo();
@@ -1,8 +1,23 @@
 #include <time.h>
+#include <poll.h>
+#include <float.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
 #include <ncurses.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <sys/time.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 
 /* BEGIN CONFIG */
@@ -25,10 +40,33 @@
 #ifndef GRAVITY
 #define GRAVITY 750
 #endif /* GRAVITY */
+
+#ifndef CLEAR_DELAY
+#define CLEAR_DELAY 400
+#endif /* CLEAR_DELAY */
+
+#ifndef BOT_DELAY
+#define BOT_DELAY 100
+#endif /* BOT_DELAY */
+
+#ifndef MAX_PIECES
+#define MAX_PIECES 1000
+#endif /* MAX_PIECES */
 /* END CONFIG */
 
+#define ARRLEN(a) (sizeof(a)/sizeof(*a))
 #define TSTOMS(TS) ((TS.tv_sec * 1000000 + TS.tv_nsec / 1000) / 1000)
 
+/* one bit per column in 64 bit words, bit x % 64 of word x / 64 set when cell
+ * x of the row is filled */
+#define WORDS ((X + 63) / 64)
+typedef uint64_t row_t[WORDS];
+
+#define WORD(x) ((x) / 64)
+#define CELL(x) ((uint64_t)1 << (x) % 64)
+/* the columns of the last word that are on the board */
+#define LAST_WORD (~(uint64_t)0 >> (64 * WORDS - X))
+
 
 struct coord {
 	int x, y;
@@ -45,6 +83,7 @@ enum tetromino {
 	TET_Z,
 	TET_T,
 	LAST,
+	GARBAGE, /* rows an opponent sent up */
 };
 
 
@@ -62,51 +101,795 @@ enum color {
 enum state {
 	RUNNING,
 	GAME_OVER,
+	WON,
 	QUIT,
 };
 
 
-/* (0,0) is the center of the top row */
-struct coord tetrominos[][4] = {
-	[TET_Q] = {{0, 0}, {1, 0}, {0, 1}, {1, 1}},
-	[TET_I] = {{0, 1}, {0, 0}, {0, 2}, {0, 3}},
-	[TET_L] = {{0, 1}, {0, 0}, {0, 2}, {1, 2}},
-	[TET_J] = {{0, 1}, {0, 0}, {0, 2}, {-1,2}},
-	[TET_S] = {{0, 0}, {1, 0}, {0, 1}, {-1,1}},
-	[TET_Z] = {{0, 0}, {-1,0}, {0, 1}, {1, 1}},
-	[TET_T] = {{0, 0}, {-1,0}, {1, 0}, {0, 1}},
+/* the settled blocks. collisions only look at rows, colors is only for drawing */
+struct board {
+	row_t rows[Y];
+	int heights[X]; /* rows up to the highest block in each column */
+	enum tetromino colors[Y][X];
+};
+
+
+/* a falling tetromino */
+struct piece {
+	enum tetromino t;
+	int rot; /* 0 as it spawns, then one more for each clockwise turn */
+	int x, y; /* top left of its 4x4 box */
 };
 
 
-bool valid(int x, int y) {
-	return x >= 0 && y >= 0 && x < X && y < Y;
+struct game {
+	struct board board;
+	int level;
+	int score;
+	int lines;
+	int total_cleared; /* lines towards the next level */
+	uint64_t rng;
+
+	struct piece cur;
+	enum tetromino next;
+	long reftime; /* game time of the last step down, in ms */
+
+	/* rows cleared less than CLEAR_DELAY ago, still flashing */
+	int flash[4];
+	int n_flash;
+	long flash_end;
+
+	/* the bot playing, NULL for a person */
+	struct policy * policy;
+	int threads;
+	long drop_at; /* when the bot drops the piece it has placed */
+	long pieces;
+	long nodes;
+	long search_ns;
+
+	/* versus: lines the opponent sent, which come up under the board when a
+	 * piece locks without clearing any, and the lines owed to the opponent */
+	int garbage;
+	int attack;
+	uint64_t holes; /* where the gap in garbage goes, apart from the pieces */
+};
+
+
+/* every rotation of every tetromino as the SRS has them, one mask per row of
+ * the box with bit x set for column x */
+uint8_t shapes[][4][4] = {
+	[TET_Q] = {{0x6, 0x6}, {0x6, 0x6}, {0x6, 0x6}, {0x6, 0x6}},
+	[TET_I] = {
+		{0x0, 0xF, 0x0, 0x0}, {0x4, 0x4, 0x4, 0x4},
+		{0x0, 0x0, 0xF, 0x0}, {0x2, 0x2, 0x2, 0x2},
+	},
+	[TET_L] = {{0x4, 0x7}, {0x2, 0x2, 0x6}, {0x0, 0x7, 0x1}, {0x3, 0x2, 0x2}},
+	[TET_J] = {{0x1, 0x7}, {0x6, 0x2, 0x2}, {0x0, 0x7, 0x4}, {0x2, 0x2, 0x3}},
+	[TET_S] = {{0x6, 0x3}, {0x2, 0x6, 0x4}, {0x0, 0x6, 0x3}, {0x1, 0x3, 0x2}},
+	[TET_Z] = {{0x3, 0x6}, {0x4, 0x6, 0x2}, {0x0, 0x3, 0x6}, {0x2, 0x3, 0x1}},
+	[TET_T] = {{0x2, 0x7}, {0x2, 0x6, 0x2}, {0x0, 0x7, 0x2}, {0x2, 0x3, 0x2}},
+};
+
+
+/* where to try the box after turning clockwise from each rotation, in order.
+ * y goes down the screen. the square never needs kicking */
+struct coord kicks[][4][5] = {
+	/* J, L, S, T, Z */
+	{
+		{{0, 0}, {-1, 0}, {-1,-1}, { 0, 2}, {-1, 2}},
+		{{0, 0}, { 1, 0}, { 1, 1}, { 0,-2}, { 1,-2}},
+		{{0, 0}, { 1, 0}, { 1,-1}, { 0, 2}, { 1, 2}},
+		{{0, 0}, {-1, 0}, {-1, 1}, { 0,-2}, {-1,-2}},
+	},
+	/* I */
+	{
+		{{0, 0}, {-2, 0}, { 1, 0}, {-2, 1}, { 1,-2}},
+		{{0, 0}, {-1, 0}, { 2, 0}, {-1,-2}, { 2, 1}},
+		{{0, 0}, { 2, 0}, {-1, 0}, { 2,-1}, {-1, 2}},
+		{{0, 0}, { 1, 0}, {-2, 0}, { 1, 2}, {-2,-1}},
+	},
+};
+
+
+// splitmix64, so that every game carries its own PRNG state
+uint32_t rng_next(uint64_t * rng) {
+	uint64_t z = (*rng += 0x9E3779B97F4A7C15);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+	return (z ^ (z >> 31)) >> 33;
+}
+
+
+enum tetromino random_tetromino(uint64_t * rng) {
+	return rng_next(rng) % ((LAST-1) - (EMPTY+1) + 1) + (EMPTY+1);
+}
+
+
+long now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return TSTOMS(ts);
+}
+
+
+long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+/* sleeps until a key is pressed, fd (unless -1) can be read or ms milliseconds
+ * pass */
+void wait_input(long ms, int fd) {
+	struct pollfd pfd[] = {
+		{.fd = STDIN_FILENO, .events = POLLIN},
+		{.fd = fd, .events = POLLIN},
+	};
+	if (ms < 0) ms = 0;
+	poll(pfd, ARRLEN(pfd), ms);
+}
+
+
+/* where a new tetromino comes in, at the top middle */
+struct piece spawn(enum tetromino t) {
+	return (struct piece){.t = t, .x = (X - 3) / 2};
+}
+
+
+/* the board cells the tetromino covers */
+void cells(struct piece * p, struct coord out[4]) {
+	int n = 0;
+	for (int r = 0; r < 4; r++) {
+		for (int m = shapes[p->t][p->rot][r]; m; m &= m - 1) {
+			out[n++] = (struct coord){p->x + __builtin_ctz(m), p->y + r};
+		}
+	}
+}
+
+
+/* whether a row of a tetromino's box, m with its first column at x, hits a
+ * block. the columns it covers have to be on the board */
+bool row_hits(row_t row, int x, uint64_t m) {
+	if (x < 0) return row[0] & m >> -x;
+	uint64_t lo = m << x % 64;
+	/* the box's last columns run into the next word */
+	uint64_t hi = WORDS > 1 && x % 64 > 60 ? m >> (64 - x % 64) : 0;
+	return row[WORD(x)] & lo || (hi && row[WORD(x) + 1] & hi);
+}
+
+
+/* whether the tetromino, moved by dx and dy, is on the board and in free cells */
+bool fits(row_t rows[Y], struct piece * p, int dx, int dy) {
+	int x = p->x + dx;
+	int y = p->y + dy;
+	for (int r = 0; r < 4; r++) {
+		uint64_t m = shapes[p->t][p->rot][r];
+		if (!m) continue;
+		if (y + r < 0 || y + r >= Y) return false;
+		/* the box hangs off the sides, only its empty columns may */
+		if (x < 0 && m & ((1 << -x) - 1)) return false;
+		if (x + 63 - __builtin_clzll(m) >= X) return false;
+		if (row_hits(rows[y + r], x, m)) return false;
+	}
+	return true;
 }
 
 
-void cptogrid(struct coord tet[4], enum tetromino t, enum tetromino grid[X][Y]) {
+/* turns the tetromino clockwise, at the first kick where it fits */
+bool rotate(row_t rows[Y], struct piece * p) {
+	if (p->t == TET_Q) return false;
+	struct coord * k = kicks[p->t == TET_I][p->rot];
+
+	struct piece turned = *p;
+	turned.rot = (p->rot + 1) % 4;
+	for (int i = 0; i < 5; i++) {
+		if (fits(rows, &turned, k[i].x, k[i].y)) {
+			turned.x += k[i].x;
+			turned.y += k[i].y;
+			*p = turned;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+void cptogrid(struct piece * p, struct board * b) {
+	struct coord c[4];
+	cells(p, c);
 	for (int i = 0; i < 4; i++) {
-		int x = tet[i].x;
-		int y = tet[i].y;
-		grid[x][y] = t;
+		int x = c[i].x;
+		int y = c[i].y;
+		b->rows[y][WORD(x)] |= CELL(x);
+		b->colors[y][x] = p->t;
+		if (Y - y > b->heights[x]) b->heights[x] = Y - y;
 	}
 }
 
 
-bool down1(struct coord tet[4], enum tetromino t,  enum tetromino grid[X][Y]) {
-	bool active = true;
+/* finds the highest block of every column, from the top down */
+void update_heights(struct board * b) {
+	row_t seen = {0};
+	int left = X; /* columns with no block found yet */
+	for (int x = 0; x < X; x++) b->heights[x] = 0;
+	for (int y = 0; y < Y && left; y++) {
+		for (int w = 0; w < WORDS; w++) {
+			for (uint64_t top = b->rows[y][w] & ~seen[w]; top; top &= top - 1) {
+				b->heights[w * 64 + __builtin_ctzll(top)] = Y - y;
+				left--;
+			}
+			seen[w] |= b->rows[y][w];
+		}
+	}
+}
+
 
+/* how many rows the tetromino falls before it lands */
+int drop_distance(struct board * b, struct piece * p) {
+	struct coord c[4];
+	cells(p, c);
+	int d = Y;
 	for (int i = 0; i < 4; i++) {
-		int nx = tet[i].x;
-		int ny = tet[i].y + 1;
-		if (!valid(nx, ny) || grid[nx][ny]) {
-			cptogrid(tet, t, grid);
-			active = false;
+		int land = Y - 1 - b->heights[c[i].x] - c[i].y;
+		if (land < d) d = land;
+	}
+	/* tucked under an overhang, the heights don't apply */
+	if (d < 0) for (d = 0; fits(b->rows, p, 0, d + 1); d++);
+	return d;
+}
+
+
+bool down1(struct piece * p, struct board * b) {
+	if (!fits(b->rows, p, 0, 1)) {
+		cptogrid(p, b);
+		return false;
+	}
+	p->y++;
+	return true;
+}
+
+
+bool row_full(row_t row) {
+	int w = 0;
+#ifdef __AVX2__
+	/* four words at a time, short of the last one which is only partly used */
+	__m256i ones = _mm256_set1_epi64x(-1);
+	for (; w + 4 < WORDS; w += 4) {
+		__m256i v = _mm256_loadu_si256((__m256i *)&row[w]);
+		if (!_mm256_testc_si256(v, ones)) return false;
+	}
+#endif
+	for (; w < WORDS - 1; w++) {
+		if (row[w] != ~(uint64_t)0) return false;
+	}
+	return row[WORDS - 1] == LAST_WORD;
+}
+
+
+/* collects the full rows, from the bottom up. only the rows the tetromino
+ * locked into can have filled up */
+int full_rows(struct board * b, struct piece * p, int rows[4]) {
+	int n = 0;
+	for (int y = p->y + 3; y >= p->y; y--) {
+		if (y >= 0 && y < Y && row_full(b->rows[y])) rows[n++] = y;
+	}
+	return n;
+}
+
+
+/* takes the full rows out of Y rows of size bytes each, in one pass moving
+ * everything between them down into their place. they're given bottom up and
+ * have to be on the board, the moves are sized by them */
+void remove_rows(void * rows, size_t size, int full[4], int n) {
+	char * r = rows;
+	for (int i = 0; i < n; i++) {
+		int top = i + 1 < n ? full[i + 1] + 1 : 0;
+		memmove(r + (top + i + 1) * size, r + top * size, (full[i] - top) * size);
+	}
+	memset(r, 0, n * size);
+}
+
+
+void clear_rows(struct board * b, int rows[4], int n) {
+	if (!n) return;
+	remove_rows(b->rows, sizeof(*b->rows), rows, n);
+	remove_rows(b->colors, sizeof(*b->colors), rows, n);
+	update_heights(b);
+}
+
+
+/* autoplay */
+/* feature weights of the board evaluation */
+#define W_HEIGHT -0.510066
+#define W_LINES 0.760666
+#define W_HOLES -0.35663
+#define W_BUMPS -0.184483
+
+/* at most 4 rotations in every column */
+#define MAX_MOVES (4 * X)
+
+/* boards a search looks at below which it isn't worth waking other threads.
+ * a board takes about 70ns and waking the pool about 1us */
+#define SEARCH_PARALLEL_WORK 1024
+
+
+/* every rotation and column the tetromino can be dropped from, at the top */
+int placements(row_t rows[Y], enum tetromino t, struct piece moves[]) {
+	// squares look the same every way, I, S and Z only two ways
+	int turns = t == TET_Q ? 1 : t == TET_I || t == TET_S || t == TET_Z ? 2 : 4;
+
+	int n = 0;
+	for (int r = 0; r < turns; r++) {
+		/* move the box up so its top block is in the top row */
+		int top = 0;
+		while (!shapes[t][r][top]) top++;
+		struct piece p = {.t = t, .rot = r, .y = -top};
+		for (p.x = -3; p.x < X; p.x++) {
+			if (fits(rows, &p, 0, 0)) moves[n++] = p;
+		}
+	}
+	return n;
+}
+
+
+/* drops the tetromino into rows and clears them, returns the rows cleared.
+ * it has to fit where it is */
+int land(row_t rows[Y], struct piece * p) {
+	/* the box's rows already moved to its column, in word w and what runs
+	 * over into the next one. only rows top to bottom have blocks, and
+	 * those are on the board, the others can be above it */
+	int x = p->x < 0 ? 0 : p->x;
+	int w = WORD(x);
+	bool spill = WORDS > 1 && x % 64 > 60;
+	uint64_t lo[4], hi[4];
+	int top = -1, bottom = 0;
+	for (int r = 0; r < 4; r++) {
+		uint64_t m = shapes[p->t][p->rot][r];
+		if (p->x < 0) m >>= -p->x;
+		lo[r] = m << x % 64;
+		hi[r] = spill ? m >> (64 - x % 64) : 0;
+		if (m && top < 0) top = r;
+		if (m) bottom = r;
+	}
+
+	int y = p->y;
+	while (y + bottom + 1 < Y) {
+		bool hit = false;
+		for (int r = top; r <= bottom; r++) {
+			if (lo[r] & rows[y + 1 + r][w]) hit = true;
+			if (spill && hi[r] & rows[y + 1 + r][w + 1]) hit = true;
+		}
+		if (hit) break;
+		y++;
+	}
+
+	int full[4];
+	int n = 0;
+	for (int r = bottom; r >= top; r--) {
+		rows[y + r][w] |= lo[r];
+		if (spill) rows[y + r][w + 1] |= hi[r];
+		if (row_full(rows[y + r])) full[n++] = y + r;
+	}
+	remove_rows(rows, sizeof(*rows), full, n);
+	return n;
+}
+
+
+double evaluate(row_t rows[Y], int lines) {
+	int heights[X] = {0};
+	int holes = 0;
+
+	/* a hole is a free cell with a block anywhere above it */
+	row_t above = {0};
+	for (int y = 0; y < Y; y++) {
+		for (int w = 0; w < WORDS; w++) {
+			for (uint64_t top = rows[y][w] & ~above[w]; top; top &= top - 1) {
+				heights[w * 64 + __builtin_ctzll(top)] = Y - y;
+			}
+			holes += __builtin_popcountll(above[w] & ~rows[y][w]);
+			above[w] |= rows[y][w];
+		}
+	}
+
+	int height = heights[0];
+	int bumps = 0;
+	for (int x = 1; x < X; x++) {
+		height += heights[x];
+		bumps += abs(heights[x] - heights[x - 1]);
+	}
+
+	return W_HEIGHT * height + W_LINES * lines + W_HOLES * holes + W_BUMPS * bumps;
+}
+
+
+struct search {
+	row_t rows[Y];
+	enum tetromino next;
+
+	int n_moves;
+	struct piece moves[MAX_MOVES];
+	/* filled in by search_move(), one slot per move so nothing is shared */
+	double scores[MAX_MOVES];
+	long nodes[MAX_MOVES];
+};
+
+
+/* scores a move by the best place for the next piece after it */
+void search_move(void * ctx, int i) {
+	struct search * s = ctx;
+
+	row_t rows[Y];
+	memcpy(rows, s->rows, sizeof(rows));
+	int lines = land(rows, &s->moves[i]);
+
+	s->nodes[i] = 1;
+	// without a next piece, the board after this move is all there is
+	if (s->next == EMPTY) {
+		s->scores[i] = evaluate(rows, lines);
+		return;
+	}
+
+	struct piece p = spawn(s->next);
+	s->scores[i] = -DBL_MAX;
+	// the next piece wouldn't even come in
+	if (!fits(rows, &p, 0, 0)) return;
+
+	struct piece next[MAX_MOVES];
+	int n = placements(rows, s->next, next);
+	for (int j = 0; j < n; j++) {
+		row_t after[Y];
+		memcpy(after, rows, sizeof(after));
+		int more = land(after, &next[j]);
+		double score = evaluate(after, lines + more);
+		if (score > s->scores[i]) s->scores[i] = score;
+	}
+	s->nodes[i] += n;
+}
+
+
+// a parallel_for() call being worked through
+struct job {
+	void (* fn)(void * ctx, int i);
+	void * ctx;
+	int n;
+
+	int next;         // next index to hand out
+	int left;         // indices not finished yet
+	struct job * link;
+};
+
+
+// threads started once and shared by every parallel_for() call. calls can
+// come from the workers themselves, like a batch game searching its moves, so
+// the newest job is handed out first
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work; // a job was posted, or the pool is stopping
+	pthread_cond_t done; // a job's last index finished
+	struct job * jobs;   // the jobs with indices left to hand out
+	bool stop;
+
+	pthread_t * threads;
+	int n;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+
+// runs the next index of job j, unlocking the pool while it runs
+void job_step(struct job * j) {
+	int i = j->next++;
+	if (j->next == j->n) {
+		struct job ** p = &pool.jobs;
+		while (*p != j) p = &(*p)->link;
+		*p = j->link;
+	}
+
+	pthread_mutex_unlock(&pool.lock);
+	j->fn(j->ctx, i);
+	pthread_mutex_lock(&pool.lock);
+
+	if (--j->left == 0) pthread_cond_broadcast(&pool.done);
+}
+
+
+void * pool_worker(void * arg) {
+	pthread_mutex_lock(&pool.lock);
+	while (true) {
+		while (!pool.jobs && !pool.stop) pthread_cond_wait(&pool.work, &pool.lock);
+		if (!pool.jobs) break;
+		job_step(pool.jobs);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+
+void pool_stop(void) {
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = true;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (int i = 0; i < pool.n; i++) pthread_join(pool.threads[i], NULL);
+	free(pool.threads);
+	pool.threads = NULL;
+	pool.n = 0;
+}
+
+
+// starts the workers, which are joined at exit. the thread calling
+// parallel_for() works too, so this is one less than the threads to use.
+// if some can't be started, the work is shared by the ones that were
+void pool_start(int workers) {
+	if (workers < 1 || pool.n) return;
+	pool.threads = malloc(workers * sizeof(*pool.threads));
+	while (pool.n < workers) {
+		int err = pthread_create(&pool.threads[pool.n], NULL, pool_worker, NULL);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
 			break;
 		}
+		pool.n++;
+	}
+	atexit(pool_stop);
+}
+
+
+// calls fn(ctx, i) for every i in [0, n) across the pool, returning once
+// they're all done
+void parallel_for(int n, void (* fn)(void *, int), void * ctx) {
+	if (n < 1) return;
+	struct job j = {
+		.fn = fn,
+		.ctx = ctx,
+		.n = n,
+		.left = n,
+	};
+
+	pthread_mutex_lock(&pool.lock);
+	j.link = pool.jobs;
+	pool.jobs = &j;
+	if (n > 1) pthread_cond_broadcast(&pool.work);
+	while (j.next < j.n) job_step(&j);
+	while (j.left > 0) pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+
+/* picks where the current piece goes, knowing the next one unless it's EMPTY.
+ * with threads over 1, big searches are shared with the thread pool.
+ * returns the number of boards looked at, 0 if the piece fits nowhere */
+long choose_move(
+	struct board * b, enum tetromino cur, enum tetromino next,
+	int threads, struct piece * move
+) {
+	struct search s;
+	memcpy(s.rows, b->rows, sizeof(s.rows));
+	s.next = next;
+	s.n_moves = placements(s.rows, cur, s.moves);
+
+	// the next piece has about as many places to go as this one
+	long work = next == EMPTY ? s.n_moves : (long)s.n_moves * s.n_moves;
+	if (threads > 1 && work >= SEARCH_PARALLEL_WORK) {
+		parallel_for(s.n_moves, search_move, &s);
+	} else {
+		for (int i = 0; i < s.n_moves; i++) search_move(&s, i);
+	}
+
+	long nodes = 0;
+	int best = -1;
+	for (int i = 0; i < s.n_moves; i++) {
+		nodes += s.nodes[i];
+		if (best < 0 || s.scores[i] > s.scores[best]) best = i;
+	}
+	if (best >= 0) *move = s.moves[best];
+	return nodes;
+}
+
+
+/* ways for the bot to pick its moves, the first is the default */
+struct policy {
+	char * name;
+	bool lookahead; /* whether it knows the next piece */
+} policies[] = {
+	{"lookahead", true},
+	{"greedy", false},
+};
+
+
+/* clears the full rows once a piece has locked, and scores them.
+ * rows gets where they were, from the bottom up */
+int score_rows(struct game * g, int rows[4]) {
+	int n = full_rows(&g->board, &g->cur, rows);
+	for (int i = 0; i < n; i++) {
+		g->lines++;
+		g->total_cleared++;
+
+		if (g->total_cleared >= 10) {
+			g->level++;
+			g->total_cleared -= 10;
+		}
+	}
+	clear_rows(&g->board, rows, n);
+
+	switch (n) {
+		case 1:
+			g->score += 40 * (g->level + 1);
+			break;
+		case 2:
+			g->score += 100 * (g->level + 1);
+			break;
+		case 3:
+			g->score += 300 * (g->level + 1);
+			break;
+		case 4:
+			g->score += 1200 * (g->level + 1);
+			break;
+	}
+	return n;
+}
+
+
+/* ms between steps down, never 0 so a game only depends on its inputs' times */
+int gravity(int level) {
+	int ms = GRAVITY - ((GRAVITY/10) * level);
+	return ms < 1 ? 1 : ms;
+}
+
+
+/* keys as they're recorded */
+enum record_op {
+	REC_END,
+	REC_LEFT,
+	REC_RIGHT,
+	REC_ROTATE,
+	REC_DOWN,
+	REC_DROP,
+	REC_QUIT,
+	REC_CHECKSUM,
+};
+
+
+/* brings in the next piece at game time t, false if there's no room for it */
+bool game_spawn(struct game * g, long t) {
+	g->cur = spawn(g->next);
+	g->next = random_tetromino(&g->rng);
+	if (!fits(g->board.rows, &g->cur, 0, 0)) return false;
+
+	if (g->policy) {
+		long start = now_ns();
+		enum tetromino next = g->policy->lookahead ? g->next : EMPTY;
+		g->nodes += choose_move(&g->board, g->cur.t, next, g->threads,
+		                        &g->cur);
+		g->search_ns += now_ns() - start;
+		g->drop_at = t + BOT_DELAY;
+	}
+	g->pieces++;
+	return true;
+}
+
+
+bool game_start(struct game * g, uint64_t seed, struct policy * policy,
+                int threads) {
+	*g = (struct game){
+		.rng = seed, .policy = policy, .threads = threads, .holes = ~seed,
+	};
+	g->next = random_tetromino(&g->rng);
+	return game_spawn(g, 0);
+}
+
+
+/* pushes the board up by the garbage lines, which are full but for one column.
+ * false if that pushes blocks off the top */
+bool game_garbage(struct game * g) {
+	struct board * b = &g->board;
+	int n = g->garbage < Y ? g->garbage : Y;
+	g->garbage = 0;
+	for (int x = 0; x < X; x++) {
+		if (b->heights[x] > Y - n) return false;
+	}
+
+	memmove(&b->rows[0], &b->rows[n], (Y - n) * sizeof(*b->rows));
+	memmove(&b->colors[0], &b->colors[n], (Y - n) * sizeof(*b->colors));
+	int hole = rng_next(&g->holes) % X;
+	for (int y = Y - n; y < Y; y++) {
+		for (int w = 0; w < WORDS - 1; w++) b->rows[y][w] = ~(uint64_t)0;
+		b->rows[y][WORDS - 1] = LAST_WORD;
+		b->rows[y][WORD(hole)] &= ~CELL(hole);
+		for (int x = 0; x < X; x++) b->colors[y][x] = x == hole ? EMPTY : GARBAGE;
+	}
+	update_heights(b);
+	return true;
+}
+
+
+/* the piece has locked at game time t. the rows are gone right away, the flash
+ * is only drawn over the board while the next piece is already falling */
+bool game_lock(struct game * g, long t) {
+	int n = score_rows(g, g->flash);
+	if (n) {
+		g->n_flash = n;
+		g->flash_end = t + CLEAR_DELAY;
+	}
+
+	/* two, three and four lines send one, two and four, less whatever was
+	 * about to come up */
+	int attack = n == 4 ? 4 : n - 1;
+	if (attack > 0) {
+		int cancel = attack < g->garbage ? attack : g->garbage;
+		g->garbage -= cancel;
+		g->attack += attack - cancel;
+	} else if (!n && g->garbage && !game_garbage(g)) {
+		return false;
+	}
+	return game_spawn(g, t);
+}
+
+
+/* moves the piece down for every step due by game time t, false on game over */
+bool game_advance(struct game * g, long t) {
+	while (t - g->reftime >= gravity(g->level)) {
+		g->reftime += gravity(g->level);
+		if (!down1(&g->cur, &g->board) && !game_lock(g, g->reftime)) {
+			return false;
+		}
 	}
-	if (active) for (int i = 0; i < 4; i++) tet[i].y++;
+	return true;
+}
+
 
-	return active;
+/* a key at game time t, false on game over */
+bool game_key(struct game * g, enum record_op op, long t) {
+	switch (op) {
+		case REC_LEFT:
+			if (fits(g->board.rows, &g->cur, -1, 0)) g->cur.x--;
+			break;
+		case REC_RIGHT:
+			if (fits(g->board.rows, &g->cur, 1, 0)) g->cur.x++;
+			break;
+		case REC_ROTATE:
+			rotate(g->board.rows, &g->cur);
+			break;
+		case REC_DOWN:
+			if (!down1(&g->cur, &g->board)) return game_lock(g, t);
+			g->score++;
+			break;
+		case REC_DROP:;
+			int d = drop_distance(&g->board, &g->cur);
+			g->cur.y += d;
+			g->score += d;
+			down1(&g->cur, &g->board);
+			return game_lock(g, t);
+		default: break;
+	}
+	return true;
+}
+
+
+uint32_t fnv1a(uint32_t h, void * p, size_t n) {
+	unsigned char * c = p;
+	for (size_t i = 0; i < n; i++) {
+		h ^= c[i];
+		h *= 16777619;
+	}
+	return h;
+}
+
+
+uint32_t game_checksum(struct game * g) {
+	uint32_t h = 2166136261u;
+	long state[] = {
+		g->level, g->score, g->lines, g->total_cleared, g->pieces,
+		g->cur.t, g->cur.rot, g->cur.x, g->cur.y, g->next,
+	};
+	h = fnv1a(h, state, sizeof(state));
+	h = fnv1a(h, &g->rng, sizeof(g->rng));
+	h = fnv1a(h, g->board.rows, sizeof(g->board.rows));
+	return h;
 }
 
 
@@ -117,36 +900,856 @@ int nlen(int n) {
 }
 
 
-void draw_grid(enum tetromino grid[X][Y], int level, int score) {
+/* what's on the screen, so a frame only redraws the cells that changed. a
+ * board bigger than the terminal is shown a part at a time, following the
+ * piece */
+struct view {
+	bool valid;
+	int x0, y0; /* the board cell in the top left corner */
+	int w, h; /* the columns and rows of the board that fit */
+	chtype cells[Y][X]; /* by where they are on the screen */
+	bool flash[Y];
+	int level, score;
+	int frames; /* times the frame was drawn, for what's drawn next to it */
+} view;
+
+
+// redraw everything on the next frame, e.g. after something drew over it
+void view_invalidate(void) {
+	view.valid = false;
+}
+
+
+/* where to start n cells out of size so from..to is in the middle of them */
+int view_center(int from, int to, int n, int size) {
+	int o = (from + to + 1 - n) / 2;
+	if (o > size - n) o = size - n;
+	return o < 0 ? 0 : o;
+}
+
+
+/* moves the view to the piece once it goes out of it, and to where the piece
+ * lands d rows further down if both fit */
+void view_follow(struct piece * p, int d) {
+	struct coord c[4];
+	cells(p, c);
+	struct coord lo = c[0], hi = c[0];
+	for (int i = 1; i < 4; i++) {
+		if (c[i].x < lo.x) lo.x = c[i].x;
+		if (c[i].x > hi.x) hi.x = c[i].x;
+		if (c[i].y < lo.y) lo.y = c[i].y;
+		if (c[i].y > hi.y) hi.y = c[i].y;
+	}
+	if (hi.y + d - lo.y < view.h) hi.y += d;
+	if (lo.x < view.x0 || hi.x >= view.x0 + view.w) {
+		view.x0 = view_center(lo.x, hi.x, view.w, X);
+	}
+	if (lo.y < view.y0 || hi.y >= view.y0 + view.h) {
+		view.y0 = view_center(lo.y, hi.y, view.h, Y);
+	}
+}
+
+
+/* the spaces and dots around a row's cells, which are then drawn again */
+void draw_row(int y) {
+	move(y + 1, 1);
+	for (int x = 0; x < view.w; x++) {
+		addstr("   ");
+		if (x < view.w - 1) addch('.');
+		view.cells[y][x] = ERR;
+	}
+}
+
+
+/* the border with the level and score over it */
+void draw_top(int level, int score) {
+	move(0, 0);
+	for (int x = 0; x < view.w; x++) addstr("++++");
+	addch('+');
+	mvprintw(0, 0, "Level: %d", level);
+	mvprintw(0, view.w * 4 + 1 - 7 - nlen(score), "Score: %d", score);
+	view.level = level;
+	view.score = score;
+}
+
+
+/* the parts that don't change during a game */
+void draw_frame(int level, int score) {
+	/* the border and the line under the board take a column and three rows */
+	view.w = (COLS - 1) / 4;
+	if (view.w > X) view.w = X;
+	if (view.w < 1) view.w = 1;
+	view.h = LINES - 3;
+	if (view.h > Y) view.h = Y;
+	if (view.h < 1) view.h = 1;
+	if (view.x0 > X - view.w) view.x0 = X - view.w;
+	if (view.y0 > Y - view.h) view.y0 = Y - view.h;
+
 	erase();
-	for (int x = 0; x < X; x++) addstr("++++");
-	addstr("+\n");
-	for (int y = 0; y < Y; y++) {
+	draw_top(level, score);
+	for (int y = 0; y < view.h; y++) {
+		mvaddch(y + 1, 0, '+');
+		draw_row(y);
 		addch('+');
-		for (int x = 0; x < X; x++) {
-			addch(' ');
-			int cp = COLOR_PAIR((enum color)grid[x][y]);
-			if (grid[x][y] && HIGHLIGHT) cp |= A_REVERSE;
-			attron(cp);
-			if (!HIGHLIGHT) addch(grid[x][y] ? '#' : ' ');
-			else addch(' ');
-			attroff(cp);
-			addch(' ');
-			if (x < X - 1) addch('.');
-		}
-		addstr("+\n");
+		view.flash[y] = false;
 	}
-	for (int x = 0; x < X; x++) addstr("++++");
+	move(view.h + 1, 0);
+	for (int x = 0; x < view.w; x++) addstr("++++");
 	addch('+');
+	view.valid = true;
+	view.frames++;
+}
 
-	mvprintw(0, 0, "Level: %d", level);
-	mvprintw(0, X * 4 + 1 - 7 - nlen(score), "Score: %d", score);
+
+void draw_game(struct game * g) {
+	struct board * b = &g->board;
+	struct piece * cur = &g->cur;
+	if (!view.valid) draw_frame(g->level, g->score);
+	if (g->level != view.level || g->score != view.score) {
+		draw_top(g->level, g->score);
+	}
+	int d = drop_distance(b, cur);
+	view_follow(cur, d);
+	int x0 = view.x0, y0 = view.y0;
+
+	/* only the part of the board in view */
+	chtype look[view.h][view.w];
+	for (int y = 0; y < view.h; y++) {
+		for (int x = 0; x < view.w; x++) {
+			enum tetromino t = b->colors[y0 + y][x0 + x];
+			look[y][x] = ' ';
+			if (!t) continue;
+			look[y][x] = COLOR_PAIR((enum color)t);
+			if (HIGHLIGHT) look[y][x] |= ' ' | A_REVERSE;
+			else look[y][x] |= '#';
+		}
+	}
+
+	struct coord c[4];
+	cells(cur, c);
+	int cp = COLOR_PAIR((enum color)cur->t);
+	for (int i = 0; i < 4; i++) {
+		int x = c[i].x - x0;
+		int y = c[i].y - y0;
+		if (x < 0 || x >= view.w) continue;
+
+		// draw where the tetromino would land
+		if (y + d >= 0 && y + d < view.h) look[y + d][x] = '+' | cp;
+
+		// draw current tetromino
+		if (y < 0) continue;
+		if (HIGHLIGHT) look[y][x] = ' ' | cp | A_REVERSE;
+		else look[y][x] = '@' | cp;
+	}
+
+	bool flash[Y] = {false};
+	for (int i = 0; i < g->n_flash; i++) {
+		int y = g->flash[i] - y0;
+		if (y >= 0 && y < view.h) flash[y] = true;
+	}
+
+	for (int y = 0; y < view.h; y++) {
+		if (flash[y] != view.flash[y]) {
+			view.flash[y] = flash[y];
+			if (!flash[y]) draw_row(y);
+			attron(COLOR_PAIR(GREEN) | A_REVERSE);
+			for (int x = 1; flash[y] && x < 4 * view.w; x++) mvaddch(y + 1, x, '#');
+			attroff(COLOR_PAIR(GREEN) | A_REVERSE);
+		}
+		if (flash[y]) continue;
+		for (int x = 0; x < view.w; x++) {
+			if (look[y][x] == view.cells[y][x]) continue;
+			mvaddch(y + 1, x * 4 + 2, look[y][x]);
+			view.cells[y][x] = look[y][x];
+		}
+	}
+
+	refresh();
+}
+
+
+/* versus over a unix domain socket */
+
+#define VS_VERSION 1
+
+/* messages are a type and its fields, all varints */
+enum vs_msg {
+	VS_HELLO, /* version, X, Y, seed */
+	VS_ROW, /* y, then the words of the row */
+	VS_SCORE,
+	VS_GARBAGE, /* lines */
+	VS_OVER, /* topped out */
+};
+
+int vs_fields[] = {
+	[VS_HELLO] = 4,
+	[VS_ROW] = 1 + WORDS,
+	[VS_SCORE] = 1,
+	[VS_GARBAGE] = 1,
+	[VS_OVER] = 0,
+};
+
+
+/* the socket never blocks. what's sent waits in out until it can go, what's
+ * received waits in in until whole messages are there */
+struct {
+	bool playing;
+	int fd; /* -1 once the opponent has gone */
+	bool host;
+
+	unsigned char * out;
+	size_t n_out, cap_out;
+	unsigned char in[64 * (5 + WORDS) * 10];
+	size_t n_in;
+
+	/* our board and piece as the opponent last heard of them */
+	row_t sent[Y];
+	int sent_score;
+
+	/* the opponent's */
+	bool hello;
+	uint64_t seed;
+	row_t rows[Y];
+	bool changed[Y];
+	int score;
+	bool score_changed;
+	int garbage; /* lines sent that the game hasn't taken yet */
+	bool over;
+	int frames; /* view.frames when it was last drawn */
+} versus = {.fd = -1};
+
+
+void vs_close(void) {
+	if (versus.fd < 0) return;
+	close(versus.fd);
+	versus.fd = -1;
+}
+
+
+void vs_put(uint64_t v) {
+	if (versus.cap_out - versus.n_out < 10) {
+		versus.cap_out = versus.cap_out ? versus.cap_out * 2 : 4096;
+		versus.out = realloc(versus.out, versus.cap_out);
+	}
+	while (v >= 0x80) {
+		versus.out[versus.n_out++] = (v & 0x7F) | 0x80;
+		v >>= 7;
+	}
+	versus.out[versus.n_out++] = v;
+}
+
+
+/* sends what it can of what's waiting */
+void vs_flush(void) {
+	size_t done = 0;
+	while (versus.fd >= 0 && done < versus.n_out) {
+		ssize_t n = send(versus.fd, versus.out + done, versus.n_out - done,
+		                 MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		if (n < 0) vs_close();
+		else done += n;
+	}
+	memmove(versus.out, versus.out + done, versus.n_out - done);
+	versus.n_out -= done;
+}
+
+
+/* false if the varint isn't all there yet */
+bool vs_get(unsigned char ** p, unsigned char * end, uint64_t * v) {
+	*v = 0;
+	for (int shift = 0; *p < end && shift < 64; shift += 7) {
+		unsigned char c = *(*p)++;
+		*v |= (uint64_t)(c & 0x7F) << shift;
+		if (!(c & 0x80)) return true;
+	}
+	return false;
+}
+
+
+/* false on a message that makes no sense */
+bool vs_handle(enum vs_msg type, uint64_t * v) {
+	switch (type) {
+		case VS_HELLO:
+			if (v[0] != VS_VERSION || v[1] != X || v[2] != Y) return false;
+			versus.hello = true;
+			versus.seed = v[3];
+			break;
+		case VS_ROW:
+			if (v[0] >= Y) return false;
+			memcpy(versus.rows[v[0]], &v[1], sizeof(row_t));
+			versus.changed[v[0]] = true;
+			break;
+		case VS_SCORE:
+			versus.score = v[0];
+			versus.score_changed = true;
+			break;
+		case VS_GARBAGE:
+			versus.garbage += v[0];
+			break;
+		case VS_OVER:
+			versus.over = true;
+			break;
+	}
+	return true;
+}
+
+
+/* reads and handles whatever has come in, without waiting for more */
+void vs_recv(void) {
+	while (versus.fd >= 0) {
+		ssize_t n = recv(versus.fd, versus.in + versus.n_in,
+		                 sizeof(versus.in) - versus.n_in, MSG_DONTWAIT);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		if (n <= 0) {
+			vs_close();
+			break;
+		}
+		versus.n_in += n;
+
+		unsigned char * p = versus.in;
+		unsigned char * end = versus.in + versus.n_in;
+		while (p < end) {
+			unsigned char * msg = p;
+			uint64_t type, v[4 + WORDS]; /* the most any message has */
+			bool whole = vs_get(&p, end, &type);
+			if (whole && type >= ARRLEN(vs_fields)) {
+				vs_close();
+				return;
+			}
+			for (int i = 0; whole && i < vs_fields[type]; i++) {
+				whole = vs_get(&p, end, &v[i]);
+			}
+			if (!whole) {
+				p = msg;
+				break;
+			}
+			if (!vs_handle(type, v)) {
+				vs_close();
+				return;
+			}
+		}
+		versus.n_in = end - p;
+		memmove(versus.in, p, versus.n_in);
+	}
+}
+
+
+/* connects to the opponent waiting at path, or waits there for one. the host's
+ * seed is the one both games use */
+bool vs_connect(char * path, uint64_t * seed) {
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: path too long\n", path);
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+
+	/* two games starting together would each find nobody there and take the
+	 * socket from the other, so only one at a time gets to look. the lock is
+	 * let go of once the host listens */
+	char lock_path[sizeof(addr.sun_path) + 5];
+	snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+	int lock = open(lock_path, O_RDWR | O_CREAT, 0600);
+	if (lock < 0 || flock(lock, LOCK_EX) < 0) {
+		perror(lock_path);
+		return false;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		if (fd < 0 || (errno != ENOENT && errno != ECONNREFUSED)) {
+			perror(path);
+			close(lock);
+			return false;
+		}
+		close(fd);
+
+		/* nobody there, or only a socket left over from a game before */
+		unlink(path);
+		int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener < 0 || bind(listener, (struct sockaddr *)&addr,
+		                         sizeof(addr)) < 0 || listen(listener, 1) < 0) {
+			perror(path);
+			close(lock);
+			return false;
+		}
+		close(lock);
+		fprintf(stderr, "waiting for an opponent on %s\n", path);
+		fd = accept(listener, NULL, NULL);
+		close(listener);
+		unlink(path);
+		if (fd < 0) {
+			perror(path);
+			return false;
+		}
+		versus.host = true;
+	} else {
+		close(lock);
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	versus.fd = fd;
+	versus.playing = true;
+
+	vs_put(VS_HELLO);
+	vs_put(VS_VERSION);
+	vs_put(X);
+	vs_put(Y);
+	vs_put(*seed);
+	long until = now() + 5000;
+	while (versus.fd >= 0 && !versus.hello && now() < until) {
+		vs_flush();
+		struct pollfd pfd = {.fd = versus.fd, .events = POLLIN};
+		poll(&pfd, 1, until - now());
+		vs_recv();
+	}
+	if (!versus.hello) {
+		fprintf(stderr, "%s: no opponent with the same X and Y\n", path);
+		return false;
+	}
+	if (!versus.host) *seed = versus.seed;
+	return true;
+}
+
+
+/* sends the rows of the board and piece that changed since the last time */
+void vs_send_board(struct game * g) {
+	row_t rows[Y];
+	memcpy(rows, g->board.rows, sizeof(rows));
+	struct coord c[4];
+	cells(&g->cur, c);
+	for (int i = 0; i < 4; i++) rows[c[i].y][WORD(c[i].x)] |= CELL(c[i].x);
+
+	for (int y = 0; y < Y; y++) {
+		if (!memcmp(rows[y], versus.sent[y], sizeof(row_t))) continue;
+		vs_put(VS_ROW);
+		vs_put(y);
+		for (int w = 0; w < WORDS; w++) vs_put(rows[y][w]);
+		memcpy(versus.sent[y], rows[y], sizeof(row_t));
+	}
+	if (g->score != versus.sent_score) {
+		vs_put(VS_SCORE);
+		vs_put(g->score);
+		versus.sent_score = g->score;
+	}
+	if (g->attack) {
+		vs_put(VS_GARBAGE);
+		vs_put(g->attack);
+		g->attack = 0;
+	}
+}
+
+
+/* the opponent's board right of ours, a character a cell. as much of its
+ * bottom as fits */
+void draw_opponent(void) {
+	int left = view.w * 4 + 3;
+	int w = COLS - left - 2 < X ? COLS - left - 2 : X;
+	int h = view.h;
+	if (w < 1) return;
+
+	bool all = versus.frames != view.frames;
+	versus.frames = view.frames;
+	bool drawn = all;
+	if (all) {
+		move(0, left);
+		for (int x = 0; x < w + 2; x++) addch('+');
+		move(h + 1, left);
+		for (int x = 0; x < w + 2; x++) addch('+');
+		for (int y = 0; y < h; y++) {
+			mvaddch(y + 1, left, '+');
+			mvaddch(y + 1, left + w + 1, '+');
+		}
+	}
+	if (all || versus.score_changed) {
+		mvprintw(0, left, "%d", versus.score);
+		versus.score_changed = false;
+		drawn = true;
+	}
+
+	for (int y = 0; y < h; y++) {
+		int by = Y - h + y;
+		if (!all && !versus.changed[by]) continue;
+		versus.changed[by] = false;
+		move(y + 1, left + 1);
+		for (int x = 0; x < w; x++) {
+			addch(versus.rows[by][WORD(x)] & CELL(x) ? '#' : ' ');
+		}
+		drawn = true;
+	}
+	if (drawn) refresh();
+}
+
+
+/* input latency */
+
+// log-linear buckets like HdrHistogram's. below HIST_SUB ns every value has a
+// bucket, above it each power of two is split into HIST_SUB / 2 buckets, which
+// keeps values to within 2 / HIST_SUB
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40 // about 18 minutes in ns, anything longer is clamped
+#define HIST_BUCKETS (HIST_SUB + (HIST_MAX_BITS - HIST_SUB_BITS) * HIST_SUB / 2)
+
+
+struct hist {
+	long counts[HIST_BUCKETS];
+	long n;
+	long max;
+	double sum;
+};
+
+
+// how long it took from reading a key to the refresh() showing it, in ns
+struct {
+	bool overlay;
+	struct hist hist;
+} lat;
+
+
+int hist_bucket(long v) {
+	if (v >= (1L << HIST_MAX_BITS)) v = (1L << HIST_MAX_BITS) - 1;
+	if (v < HIST_SUB) return v;
+	int e = 63 - __builtin_clzl(v) - HIST_SUB_BITS + 1;
+	return HIST_SUB + (e - 1) * HIST_SUB / 2 + (v >> e) - HIST_SUB / 2;
+}
+
+
+/* the highest value that goes in bucket i */
+long hist_value(int i) {
+	if (i < HIST_SUB) return i;
+	int e = (i - HIST_SUB) / (HIST_SUB / 2) + 1;
+	long m = (i - HIST_SUB) % (HIST_SUB / 2) + HIST_SUB / 2;
+	return ((m + 1) << e) - 1;
+}
+
+
+void hist_add(struct hist * h, long v) {
+	if (v < 0) v = 0;
+	h->counts[hist_bucket(v)]++;
+	h->n++;
+	h->sum += v;
+	if (v > h->max) h->max = v;
+}
+
+
+long hist_percentile(struct hist * h, double p) {
+	long want = p / 100 * h->n;
+	if (want < 1) want = 1;
+	long seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= want) return hist_value(i) < h->max ? hist_value(i) : h->max;
+	}
+	return h->max;
+}
+
+
+// one line under the board
+void draw_latency(void) {
+	move(view.h + 2, 0);
+	clrtoeol();
+	if (lat.hist.n) {
+		printw("p50 %ldus p99 %ldus max %ldus",
+		       hist_percentile(&lat.hist, 50) / 1000,
+		       hist_percentile(&lat.hist, 99) / 1000, lat.hist.max / 1000);
+	}
+	refresh();
+}
+
+
+// writes the histogram in HdrHistogram's percentile distribution format, in us
+bool hist_dump(struct hist * h, char * path) {
+	FILE * fp = fopen(path, "w");
+	if (!fp) return false;
+
+	fprintf(fp, "%12s %14s %10s %14s\n\n",
+	        "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+	long seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		if (!h->counts[i]) continue;
+		seen += h->counts[i];
+		double p = (double)seen / h->n;
+		long v = hist_value(i) < h->max ? hist_value(i) : h->max;
+		if (seen < h->n) {
+			fprintf(fp, "%12.3f %14.12f %10ld %14.2f\n",
+			        v / 1e3, p, seen, 1 / (1 - p));
+		} else {
+			fprintf(fp, "%12.3f %14.12f %10ld\n", v / 1e3, p, seen);
+		}
+	}
+	fprintf(fp, "#[Mean    = %12.3f, Total count    = %12ld]\n",
+	        h->n ? h->sum / h->n / 1e3 : 0.0, h->n);
+	fprintf(fp, "#[Max     = %12.3f]\n", h->max / 1e3);
+	fprintf(fp, "#[Buckets = %12d, SubBuckets     = %12d]\n",
+	        HIST_MAX_BITS - HIST_SUB_BITS, HIST_SUB);
+	return fclose(fp) == 0;
+}
+
+
+/* headless self-play */
+
+struct result {
+	uint64_t seed;
+	int score;
+	int lines;
+	long pieces;
+	long nodes;
+	long * latency; // ns the policy took for each piece
+};
+
+
+struct batch {
+	struct policy * policy;
+	uint64_t seed;
+	int threads; // for the search within each game
+	long max_pieces;
+	struct result * results;
+};
+
+
+// plays a game with no screen or gravity, every piece is hard dropped as soon
+// as the policy has placed it
+void batch_game(void * ctx, int i) {
+	struct batch * b = ctx;
+	struct result * r = &b->results[i];
+	r->seed = b->seed + i;
+	r->latency = malloc(b->max_pieces * sizeof(*r->latency));
+
+	struct game g;
+	bool alive = game_start(&g, r->seed, b->policy, b->threads);
+	long searched = 0;
+	while (alive && r->pieces < b->max_pieces) {
+		r->latency[r->pieces++] = g.search_ns - searched;
+		searched = g.search_ns;
+		// time stays at 0, so gravity never gets a step in
+		alive = game_key(&g, REC_DROP, 0);
+	}
+	r->score = g.score;
+	r->lines = g.lines;
+	r->nodes = g.nodes;
+}
+
+
+int cmp_long(const void * a, const void * b) {
+	long x = *(const long *)a, y = *(const long *)b;
+	return (x > y) - (x < y);
+}
+
+
+int run_batch(struct policy * policy, uint64_t seed, int games, int threads,
+              long max_pieces) {
+	struct batch b = {
+		.policy = policy,
+		.seed = seed,
+		// threads left over once every game has one go to its search
+		.threads = games < threads ? threads / games : 1,
+		.max_pieces = max_pieces,
+		.results = calloc(games, sizeof(*b.results)),
+	};
+
+	long start = now_ns();
+	parallel_for(games, batch_game, &b);
+	double elapsed = (now_ns() - start) / 1e9;
+
+	long pieces = 0, nodes = 0;
+	long total_lines = 0, total_score = 0;
+	for (int i = 0; i < games; i++) {
+		struct result * r = &b.results[i];
+		printf("seed %llu: score %d, %d lines, %ld pieces\n",
+		       (unsigned long long)r->seed, r->score, r->lines, r->pieces);
+		pieces += r->pieces;
+		nodes += r->nodes;
+		total_lines += r->lines;
+		total_score += r->score;
+	}
+
+	long * latency = malloc((pieces ? pieces : 1) * sizeof(*latency));
+	long n = 0;
+	for (int i = 0; i < games; i++) {
+		struct result * r = &b.results[i];
+		memcpy(latency + n, r->latency, r->pieces * sizeof(*latency));
+		n += r->pieces;
+		free(r->latency);
+	}
+	qsort(latency, n, sizeof(*latency), cmp_long);
+
+	printf("games: %d, threads: %d, policy: %s\n", games, threads,
+	       policy->name);
+	printf("lines: avg %.2f\n", (double)total_lines / games);
+	printf("score: avg %.2f\n", (double)total_score / games);
+	printf("pieces/s: %.0f, nodes/s: %.0f (%.3fs)\n", pieces / elapsed,
+	       nodes / elapsed, elapsed);
+	if (n) {
+		printf("move latency: p50 %.1fus, p90 %.1fus, p99 %.1fus, "
+		       "max %.1fus\n",
+		       latency[n / 2] / 1e3, latency[n * 9 / 10] / 1e3,
+		       latency[n * 99 / 100] / 1e3, latency[n - 1] / 1e3);
+	}
+
+	free(latency);
+	free(b.results);
+	return 0;
 }
 
 
-int main(void) {
-	srand(SEED);
+/* input recording and replay */
+
+#define RECORD_MAGIC "TTR"
+#define RECORD_VERSION 1
+
 
+struct recorder {
+	FILE * fp;
+	long last_t;
+};
+
+
+void put_varint(FILE * fp, uint64_t v) {
+	while (v >= 0x80) {
+		fputc((v & 0x7F) | 0x80, fp);
+		v >>= 7;
+	}
+	fputc(v, fp);
+}
+
+
+bool get_varint(FILE * fp, uint64_t * v) {
+	*v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		int c = fgetc(fp);
+		if (c == EOF) return false;
+		*v |= (uint64_t)(c & 0x7F) << shift;
+		if (!(c & 0x80)) return true;
+	}
+	return false;
+}
+
+
+// the board size and gravity change how a game plays out, so they're kept to
+// check against
+void record_start(struct recorder * r, uint64_t seed, struct policy * policy) {
+	if (!r->fp) return;
+	fwrite(RECORD_MAGIC, 1, strlen(RECORD_MAGIC), r->fp);
+	fputc(RECORD_VERSION, r->fp);
+	put_varint(r->fp, seed);
+	put_varint(r->fp, policy ? policy - policies + 1 : 0);
+	put_varint(r->fp, X);
+	put_varint(r->fp, Y);
+	put_varint(r->fp, GRAVITY);
+	r->last_t = 0;
+}
+
+
+// events are the ms since the last one, shifted up to make room for the op
+void record_event(struct recorder * r, long t, enum record_op op) {
+	if (!r->fp) return;
+	put_varint(r->fp, (uint64_t)(t - r->last_t) << 3 | op);
+	r->last_t = t;
+}
+
+
+void record_end(struct recorder * r, struct game * g, long t) {
+	if (!r->fp) return;
+	record_event(r, t, REC_CHECKSUM);
+	put_varint(r->fp, game_checksum(g));
+	record_event(r, t, REC_END);
+	fflush(r->fp);
+}
+
+
+bool read_header(FILE * fp, uint64_t * seed, struct policy ** policy) {
+	char magic[sizeof(RECORD_MAGIC)] = {0};
+	if (fread(magic, 1, strlen(RECORD_MAGIC), fp) != strlen(RECORD_MAGIC))
+		return false;
+	if (strcmp(magic, RECORD_MAGIC)) return false;
+	if (fgetc(fp) != RECORD_VERSION) return false;
+
+	uint64_t bot, x, y, grav;
+	if (!get_varint(fp, seed) || !get_varint(fp, &bot) || !get_varint(fp, &x)
+	    || !get_varint(fp, &y) || !get_varint(fp, &grav))
+		return false;
+	if (bot > ARRLEN(policies)) return false;
+	if (x != X || y != Y || grav != GRAVITY) {
+		fprintf(stderr, "recorded with X %d, Y %d and GRAVITY %d\n",
+		        (int)x, (int)y, (int)grav);
+		return false;
+	}
+	*policy = bot ? &policies[bot - 1] : NULL;
+	return true;
+}
+
+
+bool read_event(FILE * fp, long * t, enum record_op * op, uint32_t * sum) {
+	uint64_t v;
+	if (!get_varint(fp, &v)) return false;
+	*t += v >> 3;
+	*op = v & 7;
+	if (*op == REC_CHECKSUM) {
+		if (!get_varint(fp, &v)) return false;
+		*sum = v;
+	}
+	return true;
+}
+
+
+enum replay_result {
+	REPLAY_OK,
+	REPLAY_MISMATCH,
+	REPLAY_CORRUPT,
+	REPLAY_ABORTED,
+};
+
+
+// replays a single recorded game. with a speed it's drawn that many times
+// faster than it was played, otherwise it runs through without waiting
+enum replay_result replay_game(
+	FILE * fp, struct game * g, uint64_t seed, struct policy * policy,
+	int threads, int speed
+) {
+	bool alive = game_start(g, seed, policy, threads);
+	if (speed) view_invalidate();
+	bool checked = false;
+	long start = now();
+	long t = 0;
+	enum record_op op;
+	uint32_t sum = 0;
+
+	while (read_event(fp, &t, &op, &sum)) {
+		while (speed && alive) {
+			long vt = (now() - start) * speed;
+			if (vt >= t) break;
+			alive = game_advance(g, vt);
+			if (g->n_flash && vt >= g->flash_end) g->n_flash = 0;
+			draw_game(g);
+
+			long deadline = g->reftime + gravity(g->level);
+			if (g->n_flash && g->flash_end < deadline) deadline = g->flash_end;
+			if (t < deadline) deadline = t;
+			wait_input((deadline - vt + speed - 1) / speed, -1);
+			if (getch() == 'q') return REPLAY_ABORTED;
+		}
+		if (alive) alive = game_advance(g, t);
+
+		switch (op) {
+			case REC_END:
+				return checked ? REPLAY_OK : REPLAY_CORRUPT;
+			case REC_CHECKSUM:
+				if (game_checksum(g) != sum) return REPLAY_MISMATCH;
+				checked = true;
+				break;
+			default:
+				// the game ended before the player stopped playing it
+				if (!alive) return REPLAY_MISMATCH;
+				alive = game_key(g, op, t);
+		}
+	}
+	return REPLAY_CORRUPT;
+}
+
+
+void start_curses(void) {
 	initscr();
 	noecho();
 	curs_set(0);
@@ -162,237 +1765,286 @@ int main(void) {
 	init_pair(MAGENTA, COLOR_MAGENTA, -1);
 	init_pair(CYAN, COLOR_CYAN, -1);
 	init_pair(WHITE, COLOR_WHITE, -1);
+	init_pair(GARBAGE, COLOR_WHITE, -1);
+}
 
-	while (true) {
-		enum tetromino grid[X][Y] = {0};
 
-		int level = 0;
-		int score = 0;
-		int total_cleared = 0;
+void stop_curses(void) {
+	keypad(stdscr, FALSE);
+	curs_set(1);
+	echo();
+	endwin();
+}
 
-		bool active = false;
-		struct coord cur_tet[4];
-		enum tetromino tet_type;
 
-		int reftime = 0;
-		{
-			struct timespec ts;
-			clock_gettime(CLOCK_MONOTONIC, &ts);
-			reftime = TSTOMS(ts);
+int run_replay(char * path, int speed, int threads) {
+	FILE * fp = fopen(path, "rb");
+	if (!fp) {
+		perror(path);
+		return 1;
+	}
+	if (speed) start_curses();
+
+	char * results[] = {
+		[REPLAY_OK] = "ok",
+		[REPLAY_MISMATCH] = "checksum mismatch",
+		[REPLAY_CORRUPT] = "corrupt recording",
+		[REPLAY_ABORTED] = "aborted",
+	};
+	int ret = 0;
+	uint64_t seed;
+	struct policy * policy;
+	for (int n = 1; read_header(fp, &seed, &policy); n++) {
+		struct game g;
+		long start = now_ns();
+		enum replay_result res = replay_game(fp, &g, seed, policy, threads,
+		                                     speed);
+		double elapsed = (now_ns() - start) / 1e9;
+
+		if (speed) endwin();
+		printf("game %d: seed %llu, score %d, %d lines, %ld pieces, %s\n",
+		       n, (unsigned long long)seed, g.score, g.lines, g.pieces,
+		       results[res]);
+		if (!speed) printf("pieces/s: %.0f (%.3fs)\n", g.pieces / elapsed,
+		                   elapsed);
+		if (res != REPLAY_OK) {
+			if (res != REPLAY_ABORTED) ret = 1;
+			break;
 		}
+	}
 
-		enum state done = RUNNING;
-		while (!done) {
-			if (!active) {
-				int t = rand() % ((LAST-1) - (EMPTY+1) + 1) + (EMPTY+1);
-				tet_type = t;
-				for (int i = 0; i < 4; i++) {
-					int y = tetrominos[t][i].y;
-					int x = tetrominos[t][i].x + X / 2;
-					if (grid[x][y]) {
-						done = GAME_OVER;
-						goto finished;
-					}
-					cur_tet[i].x = x;
-					cur_tet[i].y = y;
-				}
-				active = true;
-			}
+	if (speed && !isendwin()) endwin();
+	fclose(fp);
+	return ret;
+}
 
-			draw_grid(grid, level, score);
-
-			// draw current tetromino
-			int cp = COLOR_PAIR((enum color)tet_type);
-			if (HIGHLIGHT) cp |= A_REVERSE;
-			attron(cp);
-			for (int i = 0; i < 4; i++) {
-				int x = cur_tet[i].x * 4 + 2;
-				int y = cur_tet[i].y + 1;
-				if (!HIGHLIGHT) mvaddch(y, x, '@');
-				else mvaddch(y, x, ' ');
-			}
-			attroff(cp);
-
-			// draw tetromino shadow
-			int x_lo = X;
-			int x_hi = -1;
-			for (int i = 0; i < 4; i++) {
-				int x = cur_tet[i].x;
-				if (x > x_hi) x_hi = x;
-				if (x < x_lo) x_lo = x;
-			}
 
-			x_lo = x_lo * 4 + 2;
-			x_hi = x_hi * 4 + 2;
+enum record_op key_op(int c) {
+	switch (c) {
+		case KEY_LEFT: return REC_LEFT;
+		case KEY_RIGHT: return REC_RIGHT;
+		case KEY_UP: return REC_ROTATE;
+		case KEY_DOWN: return REC_DOWN;
+		case ' ': return REC_DROP;
+		case 'q': return REC_QUIT;
+		default: return REC_END;
+	}
+}
 
-			for (int i = x_lo; i <= x_hi; i++) {
-				int y = Y + 1;
-				mvaddch(y, i, '_');
-			}
 
-			refresh();
+void usage(char * argv0) {
+	fprintf(stderr,
+	        "usage: %s [-a] [-p policy] [-s seed] [-j threads] [-r recording]\n"
+	        "          [-l latency] [-o socket]\n"
+	        "       %s -b [-p policy] [-s seed] [-n games] [-j threads]\n"
+	        "          [-m pieces]\n"
+	        "       %s -R recording [-v] [-x speed] [-j threads]\n",
+	        argv0, argv0, argv0);
+}
 
-			switch (getch()) {
-				case KEY_DOWN:
-					active = down1(cur_tet, tet_type, grid);
-					if (active) score++;
-					break;
-				case KEY_LEFT:
-					{
-					bool can_move = true;
-					for (int i = 0; i < 4; i++) {
-						int x = cur_tet[i].x - 1;
-						int y = cur_tet[i].y;
-						if (!valid(x, y) || grid[x][y]) {
-							can_move = false;
-							break;
-						}
-					}
-					if (!can_move) break;
 
-					for (int i = 0; i < 4; i++) cur_tet[i].x--;
+int main(int argc, char ** argv) {
+	uint64_t seed = SEED;
+	bool autoplay = false;
+	bool batch = false;
+	struct policy * policy = &policies[0];
+	int games = 32;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	long max_pieces = MAX_PIECES;
+	char * record_path = NULL;
+	char * replay_path = NULL;
+	bool visual = false;
+	int speed = 1;
+	char * latency_path = NULL;
+	char * versus_path = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "abp:s:n:j:m:r:R:vx:l:o:")) != -1) {
+		switch (opt) {
+			case 'a': autoplay = true; break;
+			case 'b': batch = true; break;
+			case 'p':
+				policy = NULL;
+				for (int i = 0; i < ARRLEN(policies); i++) {
+					if (!strcmp(optarg, policies[i].name)) {
+						policy = &policies[i];
 					}
-					break;
-				case KEY_RIGHT:
-					{
-					bool can_move = true;
-					for (int i = 0; i < 4; i++) {
-						int x = cur_tet[i].x + 1;
-						int y = cur_tet[i].y;
-						if (!valid(x, y) || grid[x][y]) {
-							can_move = false;
-							break;
-						}
-					}
-					if (!can_move) break;
+				}
+				if (!policy) {
+					fprintf(stderr, "unknown policy: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 's': seed = strtoull(optarg, NULL, 10); break;
+			case 'n': games = atoi(optarg); break;
+			case 'j': threads = atoi(optarg); break;
+			case 'm': max_pieces = atol(optarg); break;
+			case 'r': record_path = optarg; break;
+			case 'R': replay_path = optarg; break;
+			case 'v': visual = true; break;
+			case 'x': speed = atoi(optarg); break;
+			case 'l': latency_path = optarg; break;
+			case 'o': versus_path = optarg; break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (threads < 1) threads = 1;
+	pool_start(threads - 1);
 
-					for (int i = 0; i < 4; i++) cur_tet[i].x++;
-					}
-					break;
-				case KEY_UP:
-					// squares don't really rotate
-					if (tet_type == TET_Q) break;
-					/* x' = y_c - y + x_c
-					 * y' = x - x_c + y_c
-					 */
-					bool can_rotate = true;
-					struct coord ncoords[4];
-					int x_c = cur_tet[0].x;
-					int y_c = cur_tet[0].y;
-
-					for (int i = 0; i < 4; i++) {
-						int x = y_c - cur_tet[i].y + x_c;
-						int y = cur_tet[i].x - x_c + y_c;
-						ncoords[i] = (struct coord){x, y};
-
-						if (!valid(ncoords[i].x, ncoords[i].y) || grid[x][y]) {
-							can_rotate = false;
-							break;
-						}
-					}
-					if (!can_rotate) break;
+	if (batch) {
+		if (games < 1) games = 1;
+		if (max_pieces < 1) max_pieces = 1;
+		return run_batch(policy, seed, games, threads, max_pieces);
+	}
 
-					for (int i = 0; i < 4; i++) {
-						cur_tet[i] = ncoords[i];
-					}
-					break;
-				case ' ':
-					while ((active = down1(cur_tet, tet_type, grid)))
-						score++;
-					break;
-				case 'q':
-					done = QUIT;
-					goto finished;
-				case ERR:
-				deafult: break;
-			}
+	if (replay_path) {
+		if (speed < 1) speed = 1;
+		return run_replay(replay_path, visual ? speed : 0, threads);
+	}
 
-			struct timespec ts;
-			clock_gettime(CLOCK_MONOTONIC, &ts);
-			int dt = TSTOMS(ts) - reftime;
-			if (dt >= GRAVITY - ((GRAVITY/10) * level)) {
-				reftime = TSTOMS(ts);
-				active = down1(cur_tet, tet_type, grid);
-			}
+	/* what the opponent does can't be replayed */
+	if (versus_path && record_path) {
+		fprintf(stderr, "versus games can't be recorded\n");
+		return 1;
+	}
+	if (versus_path && !vs_connect(versus_path, &seed)) return 1;
+
+	struct recorder rec = {0};
+	if (record_path) {
+		rec.fp = fopen(record_path, "wb");
+		if (!rec.fp) {
+			perror(record_path);
+			return 1;
+		}
+	}
 
-			if (!active) {
-				int first_row = -1;
-
-				int rows_cleared = 0;
-				for (int y = Y - 1; y >= 0; y--) {
-					bool full_row = true;
-					for (int x = 0; x < X; x++) {
-						if (!grid[x][y]) {
-							full_row = false;
-							break;
-						}
-					}
+	/* how hard the bot worked, for the report on exit */
+	long pieces = 0;
+	long nodes = 0;
+	long search_ns = 0;
 
-					if (full_row) {
-						draw_grid(grid, level, score);
+	start_curses();
 
-						if (first_row < 0) first_row = y;
+	while (true) {
+		struct game g;
+		bool alive = game_start(&g, seed, autoplay ? policy : NULL, threads);
+		view_invalidate();
+		record_start(&rec, seed++, g.policy);
 
-						attron(COLOR_PAIR(GREEN) | A_REVERSE);
-						for (int x = 1; x < 4 * X; x++) {
-							mvaddch(y + 1, x, '#');	
-						}
-						attroff(COLOR_PAIR(GREEN) | A_REVERSE);
+		/* game time counts from here */
+		long start = now();
+		long t = 0;
+		bool dirty = true;
 
-						for (int x = 0; x < X; x++) {
-							grid[x][y] = 0;
-						}
+		/* when each key not shown yet was read, in ns */
+		long pending[64];
+		int n_pending = 0;
 
-						refresh();
-						napms(1000);
-						rows_cleared++;
-						total_cleared++;
+		enum state done = RUNNING;
+		while (alive && !done) {
+			t = now() - start;
+			long reftime = g.reftime;
+			alive = game_advance(&g, t);
+			if (g.reftime != reftime) dirty = true;
+			if (!alive) break;
+
+			if (g.n_flash && t >= g.flash_end) {
+				g.n_flash = 0;
+				dirty = true;
+			}
 
-						if (total_cleared >= 10) {
-							level++;
-							total_cleared -= 10;
-						}
-					}
+			if (versus.playing) {
+				vs_recv();
+				g.garbage += versus.garbage;
+				versus.garbage = 0;
+				if (versus.over || versus.fd < 0) {
+					done = WON;
+					break;
 				}
+			}
 
-				if (rows_cleared > 0) {
-					for (int y = first_row - rows_cleared; y >= 0; y--) {
-						for (int x = 0; x < X; x++) {
-							grid[x][y + rows_cleared] = grid[x][y];
-						}
-					}
+			int c = getch();
+			long read_at = now_ns();
+			enum record_op op = key_op(c);
+			/* the bot has already moved the piece, it only needs dropping */
+			if (g.policy && op != REC_QUIT) {
+				op = t >= g.drop_at ? REC_DROP : REC_END;
+			}
+
+			if (op != REC_END) {
+				record_event(&rec, t, op);
+				if (op == REC_QUIT) done = QUIT;
+				else alive = game_key(&g, op, t);
+				if (!g.policy && n_pending < ARRLEN(pending)) {
+					pending[n_pending++] = read_at;
 				}
+				dirty = true;
+				continue;
+			}
+			if (c == KEY_RESIZE) {
+				view_invalidate();
+				dirty = true;
+			}
+			if (c == 'l') {
+				lat.overlay = !lat.overlay;
+				move(view.h + 2, 0);
+				clrtoeol();
+				dirty = true;
+			}
+			if (c != ERR) continue;
+
+			/* only draw once everything pending has been handled */
+			if (dirty) {
+				draw_game(&g);
+				dirty = false;
 
-				switch (rows_cleared) {
-					case 1:
-						score += 40 * (level + 1);
-						break;
-					case 2:
-						score += 100 * (level + 1);
-						break;
-					case 3:
-						score += 300 * (level + 1);
-						break;
-					case 4:
-						score += 1200 * (level + 1);
-						break;
+				long shown = now_ns();
+				for (int i = 0; i < n_pending; i++) {
+					hist_add(&lat.hist, shown - pending[i]);
 				}
+				n_pending = 0;
+				if (lat.overlay) draw_latency();
+				if (versus.playing) vs_send_board(&g);
 			}
+			if (versus.playing) {
+				draw_opponent();
+				vs_flush();
+			}
+			long deadline = g.reftime + gravity(g.level);
+			if (g.n_flash && g.flash_end < deadline) deadline = g.flash_end;
+			if (g.policy && g.drop_at < deadline) deadline = g.drop_at;
+			wait_input(deadline - t, versus.fd);
+		}
+		if (!alive) done = GAME_OVER;
+		record_end(&rec, &g, t);
+
+		if (versus.playing) {
+			if (done == GAME_OVER) vs_put(VS_OVER);
+			vs_flush();
+			vs_close();
 		}
 
-		finished:
+		pieces += g.pieces;
+		nodes += g.nodes;
+		search_ns += g.search_ns;
+
 		switch (done) {
 			case GAME_OVER:
-				move((Y + 1) / 2, (X * 4 + 2) / 2 - 5);
+			case WON:
+				move((view.h + 1) / 2, (view.w * 4 + 2) / 2 - 5);
 				if (!HIGHLIGHT) attron(A_REVERSE);
-				addstr("Game over");
-				move((Y + 1) / 2 + 1, (X * 4 + 2) / 2 - 13);
+				addstr(done == WON ? " You won " : "Game over");
+				move((view.h + 1) / 2 + 1, (view.w * 4 + 2) / 2 - 13);
 				addstr("Press any key to continue");
 				if (!HIGHLIGHT) attroff(A_REVERSE);
 				refresh();
 				timeout(-1);
 				getch();
 				timeout(0);
+				/* a versus game is a single round */
+				if (versus.playing) goto terminate;
 				break;
 			case QUIT:
 				goto terminate;
@@ -400,8 +2052,19 @@ int main(void) {
 	}
 
 	terminate:
-	keypad(stdscr, FALSE);
-	curs_set(1);
-	echo();
-	endwin();
+	stop_curses();
+	if (rec.fp) fclose(rec.fp);
+
+	if (latency_path && lat.hist.n) {
+		if (!hist_dump(&lat.hist, latency_path)) perror(latency_path);
+		printf("input latency: %ld keys, p50 %ldus, p99 %ldus, max %ldus\n",
+		       lat.hist.n, hist_percentile(&lat.hist, 50) / 1000,
+		       hist_percentile(&lat.hist, 99) / 1000, lat.hist.max / 1000);
+	}
+
+	if (autoplay && search_ns) {
+		double secs = search_ns / 1e9;
+		printf("%ld pieces, %.0f pieces/s, %.0f nodes/s\n",
+		       pieces, pieces / secs, nodes / secs);
+	}
 }